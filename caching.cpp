@@ -1,8 +1,37 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <math.h>
+#include <atomic>
+#include <thread>
+#include <new>
+
+// building with -DPROFILE times the major stages of the simulator itself, and -DPROFILE_COUNTERS
+// adds the Linux hardware performance counters to each stage
+#ifdef PROFILE
+#include <mutex>
+#include <chrono>
+#ifdef PROFILE_COUNTERS
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+
+// the lockstep direct mapped engine uses AVX-512 or AVX2 when the build targets them (-mavx512f or
+// -mavx2), and the tag index probes with SSE2 when it's there
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -16,6 +45,11 @@ using namespace std;
 #ifndef BLOCK_SIZE
 #define BLOCK_SIZE    8
 #endif
+// the blocks are grouped into sets of this many ways -- by default we're fully associative
+#ifndef CACHE_WAYS
+#define CACHE_WAYS    CACHE_BLOCKS
+#endif
+#define CACHE_SETS    (CACHE_BLOCKS / CACHE_WAYS)
 
 // constants for our processor definition
 #define WORD_SIZE     2
@@ -23,19 +57,208 @@ using namespace std;
 #define REGISTERS     16
 // our data area is now based on blocks
 #define DATA_SIZE     (1024/BLOCK_SIZE)  
+#define DATA_WORDS    (DATA_SIZE * BLOCK_SIZE)
+
+// alignment of our data memory and cache lines so block copies stay on host cache lines
+#define STORAGE_ALIGN 64
+
+// the most pauses a shared cache thread spins for between looks at a set's lock before yielding
+#define SPIN_LIMIT    64
 
 // number of bytes to print on a line
 #define LINE_LENGTH   32
+#define LINE_WORDS    (LINE_LENGTH / WORD_SIZE)
+
+// the most a printed memory line can take: an address, each word in hex and the ASCII
+#define LINE_CHARS    (6 + LINE_WORDS * 5 + 2 + LINE_LENGTH + 2)
+
+// the most differences we list when comparing images
+#define DIFF_LIMIT    32
+
+// the instruction budget a run gets unless -i says otherwise, so that loops which keep changing
+// memory (and so can't be caught as infinite) still end
+#define INSTRUCTION_LIMIT  100000000
+
+// differential testing: the instructions we keep for context and the most we run each program for
+#define HISTORY_LENGTH  8
+#define FUZZ_CODE       64
+#define FUZZ_LIMIT      20000
+
+// macros for our block bitmaps
+#define BITMAP_BITS   (sizeof(unsigned long) * 8)
+#define BITMAP_WORDS( bits ) ((bits + BITMAP_BITS - 1) / BITMAP_BITS)
+#define bitmap_test( map, bit ) ((map[(bit) / BITMAP_BITS] >> ((bit) % BITMAP_BITS)) & 1)
 
 // our filled illegal instruction
 #define MEM_FILLER    0xFF
 
-// don't allow for more than 1000000 branches
-#define BRANCH_LIMIT  1000000
+// number of accesses the batch interface reads ahead to prefetch metadata for
+#ifndef BATCH_PREFETCH
+#define BATCH_PREFETCH 4
+#endif
+
+// number of accesses we buffer when recording or replaying a trace
+#define TRACE_CHUNK   4096
+
+// number of accesses each partition's queue holds when replaying by set (must be a power of 2)
+#define PARTITION_QUEUE 16384
+
+// set dueling -- leader sets are spread DUEL_SPACING sets apart and their misses move a selector
+// that saturates at PSEL_MAX, which we check on every DUEL_WINDOW accesses to see who's winning
+#define DUEL_SPACING  (CACHE_SETS < 32 ? CACHE_SETS : 32)
+#define PSEL_MAX      1023
+#define DUEL_WINDOW   1024
+#define DUEL_HISTORY  16
+
+// bimodal insertion only puts one new block in this many at the most recently used position
+#define BIP_THROTTLE  32
+
+// the PC-aware policies keep a saturating counter for each MOVE -- a PC always fits in CODE_SIZE,
+// so unlike real hardware we don't need to hash it into a smaller table
+#define SIGNATURE_MAX     7
+#define HAWKEYE_FRIENDLY  4     // Hawkeye counters at or above this predict that a block will be reused
+
+// the largest re-reference prediction value each policy gives a block -- blocks at the maximum go first
+#define SHIP_RRPV_MAX     3
+#define HAWKEYE_RRPV_MAX  7
+
+// the number of accesses to a set that Hawkeye's OPTgen looks back over
+#define OPTGEN_LENGTH (8 * CACHE_WAYS)
+
+// the block id given to an access that bypasses the cache
+#define BYPASSED      -1
+
+// a compressed cache has this many tags for each line's worth of data in a set
+#ifndef COMPRESSION_TAGS
+#define COMPRESSION_TAGS  2
+#endif
+#define SET_BYTES     (CACHE_WAYS / COMPRESSION_TAGS * BLOCK_SIZE * WORD_SIZE)
+#define LINE_BYTES    (BLOCK_SIZE * WORD_SIZE)
+
+// the cycles it takes to decompress a line on a hit
+#define BDI_LATENCY   1
+#define FPC_LATENCY   5
+
+// the DRAM behind the cache -- each channel has its own bus and ranks of banks, each bank
+// has a row buffer of DRAM_ROW_WORDS words, and consecutive rows are spread across the channels, banks and ranks
+#ifndef DRAM_CHANNELS
+#define DRAM_CHANNELS 1
+#endif
+#ifndef DRAM_RANKS
+#define DRAM_RANKS    2
+#endif
+#ifndef DRAM_BANKS
+#define DRAM_BANKS    4
+#endif
+#ifndef DRAM_ROW_WORDS
+#define DRAM_ROW_WORDS 64
+#endif
+
+// DRAM timing in processor cycles: activating a row, precharging it and reading a column, and the
+// words a channel's bus moves in a cycle
+#define DRAM_TRCD     14
+#define DRAM_TRP      14
+#define DRAM_TCAS     14
+#define DRAM_BUS_WORDS 4
+
+// the requests the memory controller can hold -- writes wait here until they're scheduled or it fills up
+#define DRAM_QUEUE    16
+
+// SHARDS samples the tags whose hash modulo MRC_MODULUS is under a threshold
+#define MRC_MODULUS   (1UL << 24)
+
+// the sampled blocks are split into this many groups by their hash, to see how much the estimate
+// depends on which blocks happened to be sampled
+#define MRC_GROUPS    8
+
+// the all associativity sweep covers every power of two sets up to the blocks of memory -- this is
+// enough of them for one word blocks
+#define SWEEP_LEVELS  11
+
+// the most cache levels below ours that a hierarchy in a filtered sweep can have
+#define LOWER_LEVELS  2
+
+// the blocks most recently found that find_block() checks before looking through the set
+#ifndef LOOKASIDE_BLOCKS
+#define LOOKASIDE_BLOCKS 1
+#endif
+
+// a fully associative cache of at least this many blocks finds its tags through a hash table
+// rather than searching every block
+#ifndef TAG_INDEX_BLOCKS
+#define TAG_INDEX_BLOCKS 32
+#endif
+#define TAG_INDEX     (CACHE_SETS == 1 && CACHE_BLOCKS >= TAG_INDEX_BLOCKS)
+
+// the tag index is probed a group of this many slots at a time, and has a power of two slots --
+// at least twice the blocks, so probes stay short
+#define TAG_GROUP     16
+static constexpr int tag_index_slots(int slots)
+{
+  return slots >= 2 * CACHE_BLOCKS ? slots : tag_index_slots(slots * 2);
+}
+#define TAG_INDEX_SLOTS (TAG_INDEX ? tag_index_slots(TAG_GROUP) : TAG_GROUP)
+
+// the control byte of a tag index slot that's never been used or whose tag has gone -- a slot
+// that's in use has seven bits of its tag's hash instead
+#define TAG_EMPTY     ((signed char)0x80)
+#define TAG_DELETED   ((signed char)0xFE)
+
+// the shared cache model for -Q charges this many cycles for each miss, and UCP repartitions the
+// ways after this many accesses to it
+#define MISS_PENALTY  100
+#define UCP_INTERVAL  1000
+
+// the most direct mapped caches the lockstep engine simulates side by side, and the lanes it
+// pads them out to a multiple of so every vector is full
+#define LOCKSTEP_LANES 32
+#define LOCKSTEP_WIDTH 16
+
+// the lockstep engine keeps 32 bit miss counts in its vectors, adding them to the totals this often
+#define LOCKSTEP_FLUSH (1UL << 30)
+
+// the transfers that can be waiting for or using the bus between the cache and memory before
+// whoever wants to make another one has to wait
+#define BUS_QUEUE     8
+
+// software prefetch hint for the host
+#ifdef __GNUC__
+#define prefetch( addr ) __builtin_prefetch( addr )
+#else
+#define prefetch( addr )
+#endif
+
+// the parts of the simulator we time when profiling
+enum STAGES
+{
+  STAGE_FETCH_INSTR,
+  STAGE_DECODE_INSTR,
+  STAGE_CALCULATE_EA,
+  STAGE_FETCH_OPERANDS,
+  STAGE_EXECUTE_INSTR,
+  STAGE_WRITE_BACK,
+  STAGE_FIND_BLOCK,
+  STAGE_FETCH_BLOCK,
+  STAGE_REMOVE_LRU,
+  STAGE_INSERT_DATA,
+  STAGE_PRINT_MEMORY,
+  NUM_STAGES
+};
+
+// the hardware counters we can read for each stage
+enum PROFILE_COUNTERS_IDS
+{
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_LLC_MISSES,
+  COUNTER_BRANCH_MISSES,
+  NUM_COUNTERS
+};
 
 // macros to convert between tags and addresses
 #define addr2tag( addr ) (addr/BLOCK_SIZE)
 #define addr2offset( addr ) (addr%BLOCK_SIZE)
+#define addr2sector( addr ) (addr2offset(addr)/sector_size)
 
 // our opcodes are nicely incremental
 enum OPCODES
@@ -67,8 +290,9 @@ enum PHASES
   NUM_PHASES,
   // the following are error return codes that the state machine may return
   ILLEGAL_OPCODE,    // indicates that we can't execute anymore instructions
-  INFINITE_LOOP,     // indicates that we think we have an infinite loop
+  INFINITE_LOOP,     // indicates that the program state repeated, so we'll never stop
   ILLEGAL_ADDRESS,   // inidates that we have an memory location that's out of range
+  BUDGET_EXHAUSTED,  // indicates that we've run for as long as we were allowed to
 };
 
 typedef enum PHASES Phase;
@@ -99,12 +323,540 @@ struct CACHE_ENTRY
 {
   bool           valid;
   bool           dirty;
+  bool           reused;        // SHiP -- hit since it was brought in
+  unsigned char  list;          // the ARC list it's on (ARC_T1 or ARC_T2)
+  unsigned char  rrpv;          // SHiP and Hawkeye -- how far off its next use is predicted to be
   unsigned long  ref_count;     // the smallest value gets replaced
   unsigned short tag;           // how many bits?
+  unsigned short pc;            // the MOVE that brought it in (SHiP) or last used it (Hawkeye)
+  unsigned short size;          // the bytes it takes up when the cache is compressed
+  unsigned long  sectors;       // a bit for each sector that's been filled
+  unsigned long  dirty_words;   // a bit for each word that's been written -- only used when sectored
+  unsigned long  silent_words;  // a bit for each word a silent store left alone
 };
 
 typedef struct CACHE_ENTRY CacheEntry;
 
+// the replacement policies the cache can use -- see the replacement policy routines
+enum REPLACEMENT_POLICIES
+{
+  POLICY_LRU,        // the least recently used block goes and new blocks are the most recently used
+  POLICY_BIP,        // LRU, but most new blocks go in at the least recently used position
+  POLICY_DIP,        // LRU or BIP insertion, whichever is winning the set duel
+  POLICY_ARC,        // adaptive replacement, balancing blocks seen once against blocks seen again
+  POLICY_SHIP,       // re-reference prediction, learning from each MOVE whether its blocks get reused
+  POLICY_HAWKEYE,    // re-reference prediction, learning from each MOVE whether OPT would have kept its blocks
+  NUM_POLICIES
+};
+
+// ARC's lists -- blocks seen once (T1) or more (T2), and the tags recently evicted from each
+enum ARC_LISTS
+{
+  ARC_T1,
+  ARC_T2,
+  ARC_B1,
+  ARC_B2
+};
+
+// how a block's tag picks the set it goes in -- see the set index routines
+enum INDEX_FUNCTIONS
+{
+  INDEX_MODULO,      // the low bits of the tag
+  INDEX_XOR,         // the tag folded onto itself with XOR
+  INDEX_PRIME,       // the tag modulo the largest prime number of sets we have
+  INDEX_SKEW,        // a different hash for each way
+  NUM_INDEX_FUNCTIONS
+};
+
+// how a compressed cache compresses its lines -- see the cache compression routines
+enum COMPRESSION_ALGORITHMS
+{
+  COMPRESSION_NONE,
+  COMPRESSION_BDI,   // base-delta-immediate
+  COMPRESSION_FPC,   // frequent pattern compression
+  NUM_COMPRESSION_ALGORITHMS
+};
+
+// how the DRAM manages its row buffers -- see the main memory routines
+enum PAGE_POLICIES
+{
+  PAGE_NONE,         // no DRAM model, memory takes no time
+  PAGE_OPEN,         // rows stay open after an access, hoping the next one hits the row buffer
+  PAGE_CLOSED,       // rows are closed (precharged) as soon as they've been accessed
+  NUM_PAGE_POLICIES
+};
+
+// how the shared cache modelled by -Q divides its ways between the programs
+enum QOS_SCHEMES
+{
+  QOS_SHARED,        // no partitioning -- LRU over everyone's blocks
+  QOS_CAT,           // each program can only fill the ways in its mask, as with Intel's CAT
+  QOS_UCP,           // utility based partitioning, giving the ways to the programs that gain most from them
+  NUM_QOS_SCHEMES
+};
+
+// the part a set plays in the DIP duel
+enum DUEL_ROLES
+{
+  DUEL_FOLLOWER,     // uses whichever insertion policy is winning
+  DUEL_LRU_LEADER,   // always uses LRU insertion
+  DUEL_BIP_LEADER    // always uses BIP insertion
+};
+
+// a block ARC has evicted but still remembers, so that it can tell when it evicted the wrong one
+struct GHOST_ENTRY
+{
+  bool           valid;
+  unsigned char  list;          // ARC_B1 or ARC_B2
+  unsigned short tag;
+  unsigned long  ref_count;     // when it was evicted -- the smallest value is forgotten first
+};
+
+typedef struct GHOST_ENTRY GhostEntry;
+
+// ARC's state for a set -- there are never more ghosts than blocks
+struct ARC_SET
+{
+  int        target;            // how many of the set's blocks T1 should hold
+  GhostEntry ghosts[CACHE_WAYS];
+};
+
+typedef struct ARC_SET ArcSet;
+
+// the kinds of data accesses the cache sees
+enum ACCESS_OPS
+{
+  ACCESS_READ,
+  ACCESS_WRITE
+};
+
+// a single data access as seen by the batch interface -- this is also our trace record
+// note that traces are written with the host layout of this structure
+struct ACCESS
+{
+  unsigned short pc;            // the MOVE instruction responsible
+  unsigned short addr;          // word address
+  unsigned short value;         // the data written, or the data read once processed
+  unsigned char  op;            // one of ACCESS_OPS
+};
+
+typedef struct ACCESS Access;
+
+// a read or write waiting in the memory controller
+struct DRAM_REQUEST
+{
+  unsigned long  id;
+  unsigned long  arrival;       // the cycle it was made
+  unsigned short addr;          // the first word
+  unsigned short words;
+  bool           write;
+};
+
+typedef struct DRAM_REQUEST DramRequest;
+
+// a bank's row buffer and when it can take its next request
+struct DRAM_BANK
+{
+  long          open_row;       // -1 when it's been precharged
+  unsigned long ready;
+};
+
+typedef struct DRAM_BANK DramBank;
+
+// the memory controller and the DRAM behind it
+struct DRAM
+{
+  DramBank      banks[DRAM_CHANNELS][DRAM_RANKS][DRAM_BANKS];
+  unsigned long bus_free[DRAM_CHANNELS];  // when each channel's bus is next free
+  DramRequest   queue[DRAM_QUEUE];
+  int           queued;
+  unsigned long clock;                    // when the controller made its last decision
+  unsigned long next_id;
+  
+  // what it did
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long row_hits;
+  unsigned long row_empty;                // accesses to a bank without an open row
+  unsigned long bank_conflicts;           // accesses to a bank with another row open
+  unsigned long read_latency;
+  unsigned long write_latency;
+  unsigned long stall_cycles;
+};
+
+typedef struct DRAM Dram;
+
+// the bus between the caches and memory, shared by every machine -- reads are [0] and writes [1]
+struct BUS
+{
+  unsigned long finishes[BUS_QUEUE];      // when the last BUS_QUEUE transfers finish, oldest at next
+  int           next;
+  unsigned long free;                     // when the bus is next free
+  
+  // what it did
+  unsigned long transfers[2];
+  unsigned long bytes[2];
+  unsigned long busy[2];                  // the cycles spent moving data
+  unsigned long queue_delay[2];           // the cycles transfers waited for the bus
+  unsigned long back_pressure;            // the cycles requesters were held because the queue was full
+  unsigned long zero_flags;               // zero line writebacks, sent as a flag beside the transfers
+};
+
+typedef struct BUS Bus;
+
+// SHARDS sampling for the miss ratio curve -- see the miss ratio curve routines
+struct MRC
+{
+  unsigned long  threshold;                   // tags hashing below this are sampled
+  unsigned short stack[DATA_SIZE];            // the sampled tags, most recently used first
+  int            tracked;
+  double         histogram[MRC_GROUPS][DATA_SIZE + 1]; // sampled accesses by scaled stack distance, cold misses last
+  unsigned long  accesses;
+  unsigned long  samples;
+};
+
+typedef struct MRC Mrc;
+
+// the all associativity sweep -- every block in LRU order, and for each power of two sets, how
+// many accesses found their block that far down its set's stack (cold misses last)
+struct SWEEP
+{
+  unsigned short stack[DATA_SIZE];
+  int            tracked;
+  unsigned long  histogram[SWEEP_LEVELS][DATA_SIZE + 1];
+  unsigned long  accesses;
+};
+
+typedef struct SWEEP Sweep;
+
+// the geometry of a cache level below ours
+struct LOWER_LEVEL
+{
+  int sets;
+  int ways;
+};
+
+typedef struct LOWER_LEVEL LowerLevel;
+
+// a hierarchy of lower levels for the filtered sweep, and what happened in each level
+struct HIERARCHY
+{
+  string        name;
+  LowerLevel    levels[LOWER_LEVELS];
+  int           depth;
+  unsigned long reads[LOWER_LEVELS];
+  unsigned long writes[LOWER_LEVELS];
+  unsigned long read_misses[LOWER_LEVELS];
+  unsigned long write_misses[LOWER_LEVELS];
+  unsigned long writebacks[LOWER_LEVELS];
+};
+
+typedef struct HIERARCHY Hierarchy;
+
+// a cache level below ours as the sweep simulates it -- tags of -1 are empty
+struct LOWER_CACHE
+{
+  vector<int>           tags;
+  vector<unsigned long> stamps;
+  vector<bool>          dirty;
+  unsigned long         clock;
+};
+
+typedef struct LOWER_CACHE LowerCache;
+
+// the direct mapped caches the lockstep engine simulates, a lane apiece -- each lane's block number
+// is the address shifted right by its shift, its line is the block number masked by its mask, and
+// its lines' tags start at its base in tags (holding the whole block number, or -1 when empty)
+struct LOCKSTEP
+{
+  alignas(64) int32_t shifts[LOCKSTEP_LANES];
+  alignas(64) int32_t masks[LOCKSTEP_LANES];
+  alignas(64) int32_t bases[LOCKSTEP_LANES];
+  alignas(64) int32_t misses[LOCKSTEP_LANES];
+  unsigned long       total_misses[LOCKSTEP_LANES];
+  string              names[LOCKSTEP_LANES];
+  int                 configs;                  // the lanes in use, before padding
+  int                 lanes;
+  vector<int32_t>     tags;
+  unsigned long       accesses;
+};
+
+typedef struct LOCKSTEP Lockstep;
+
+// a block of the shared cache model, or of a program's shadow tags
+struct SHARED_BLOCK
+{
+  bool          valid;
+  int           program;
+  unsigned long tag;
+  unsigned long stamp;          // the largest was used most recently
+};
+
+typedef struct SHARED_BLOCK SharedBlock;
+
+// the shared cache as one scheme divides it, and how each program did in it
+struct QOS_CACHE
+{
+  vector<SharedBlock>   blocks;
+  vector<unsigned long> accesses;
+  vector<unsigned long> hits;
+};
+
+typedef struct QOS_CACHE QosCache;
+
+// the shared cache model -- the cache under each scheme, the CAT masks and UCP's way allocation,
+// and the utility monitors: each program's shadow tags with the hits at each LRU stack position
+struct QOS
+{
+  QosCache              schemes[NUM_QOS_SCHEMES];
+  vector<unsigned long> masks;
+  vector<int>           allocation;
+  vector<SharedBlock>   shadows;
+  vector<unsigned long> position_hits;
+  vector<unsigned long> alone_hits;
+  vector<int>           owned;          // UCP's count of each program's blocks in the set it's filling
+  int                   programs;
+  unsigned long         clock;
+  unsigned long         repartitions;
+};
+
+typedef struct QOS Qos;
+
+// a set's spinlock for the shared cache, and the LRU stamps it hands out to its blocks
+// each one gets its own host cache line so threads working on different sets don't collide
+struct SET_LOCK
+{
+  alignas(STORAGE_ALIGN) std::atomic<bool> locked;
+  unsigned long stamp;          // only touched by the thread holding the lock
+};
+
+typedef struct SET_LOCK SetLock;
+
+// a single producer, single consumer ring of accesses feeding one partition's thread
+// the indices only ever increase and are masked into the ring when used
+// note that these are allocated on the heap, so we pad rather than align to keep the indices apart
+struct ACCESS_QUEUE
+{
+  std::atomic<size_t> head;     // next access the consumer takes
+  char                head_pad[STORAGE_ALIGN - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;     // next slot the producer fills
+  char                tail_pad[STORAGE_ALIGN - sizeof(std::atomic<size_t>)];
+  Access              slots[PARTITION_QUEUE];
+};
+
+typedef struct ACCESS_QUEUE AccessQueue;
+
+// aggregate counters returned by the batch interface
+struct CACHE_STATS
+{
+  unsigned long accesses;
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long writebacks;     // dirty blocks returned to memory
+  unsigned long illegal;        // accesses outside of the data area (skipped)
+  unsigned long sector_misses;  // misses where the block was there but not the word's sector
+  unsigned long contended;      // times the shared cache had to wait for a set
+};
+
+typedef struct CACHE_STATS CacheStats;
+
+// what print_memory() shows at the end of a run
+enum DUMP_MODES
+{
+  DUMP_ALL,          // every line of the data area
+  DUMP_MODIFIED,     // only lines holding blocks that were written back
+  DUMP_RANGE,        // only lines within an address range
+  DUMP_NONE
+};
+
+// the limits we can put on a run -- zero means unlimited
+enum BUDGETS
+{
+  INSTRUCTION_BUDGET,
+  CYCLE_BUDGET,
+  ACCESS_BUDGET,
+  NUM_BUDGETS
+};
+
+// a snapshot of everything that decides where a program goes next, taken at backward branches
+// memory is represented by a count of the writes that changed it
+struct LOOP_STATE
+{
+  unsigned long  hash;
+  unsigned long  memory_generation;
+  unsigned short PC;
+  unsigned short registers[REGISTERS];
+};
+
+typedef struct LOOP_STATE LoopState;
+
+// how an instruction ended for the reference interpreter
+enum REFERENCE_RESULTS
+{
+  REFERENCE_OK,
+  REFERENCE_ILLEGAL_OPCODE,
+  REFERENCE_ILLEGAL_ADDRESS
+};
+
+// an independent, straightforward model of the processor that the control unit is checked against
+struct REFERENCE_MACHINE
+{
+  unsigned short PC;
+  unsigned short registers[REGISTERS];
+  uint16_t       memory[DATA_WORDS];
+  int            accesses;            // the accesses made by the last instruction
+  Access         access[1];
+};
+
+typedef struct REFERENCE_MACHINE ReferenceMachine;
+
+// Hawkeye's OPTgen -- each set's clock and how many of its blocks OPT holds at each recent tick,
+// and when each memory block was last used and by which MOVE
+struct OPTGEN
+{
+  unsigned long  set_clock[CACHE_SETS];
+  unsigned short occupancy[CACHE_SETS][OPTGEN_LENGTH];
+  unsigned long  block_clock[DATA_SIZE];
+  unsigned short block_pc[DATA_SIZE];
+};
+
+typedef struct OPTGEN OptGen;
+
+// the original fully associative, ref_count based LRU cache, applied to each set
+struct REFERENCE_CACHE
+{
+  bool          valid[CACHE_BLOCKS];
+  unsigned long tag[CACHE_BLOCKS];
+  unsigned long sectors[CACHE_BLOCKS];
+  unsigned long ref_count[CACHE_BLOCKS];
+  unsigned long current_ref_count;
+};
+
+typedef struct REFERENCE_CACHE ReferenceCache;
+
+// everything that makes up one simulated machine: its processor, memory, cache and counts
+// we normally only have the one, but run_jobs() interleaves many of them on one thread
+struct MACHINE
+{
+  // tracks what we're currently doing
+  State state;
+  
+  // our general purpose registers
+  // NOTE: we let the registers match the host endianness so that the operations are easier -- all mapping occurs at the MDR
+  unsigned short registers[REGISTERS];
+  
+  // memory for our code and data
+  unsigned char code[CODE_SIZE][WORD_SIZE];
+  // must reorganize memory to match our cache layout
+  // NOTE: data words are kept in host endianness -- the big endian mapping only happens when
+  // loading the data file and printing memory, so cache accesses are single loads/stores
+  alignas(STORAGE_ALIGN) uint16_t data[DATA_SIZE][BLOCK_SIZE];
+  
+  // our cache area
+  alignas(STORAGE_ALIGN) uint16_t data_cache[CACHE_BLOCKS][BLOCK_SIZE];
+  // the cache dictionary
+  CacheEntry dictionary[CACHE_BLOCKS];
+  
+  // the tag index of a big fully associative cache -- see the tag index routines
+  alignas(TAG_GROUP) signed char tag_control[TAG_INDEX_SLOTS];
+  int                            tag_blocks[TAG_INDEX_SLOTS];
+  int                            tag_slots_used;      // including the deleted ones
+  
+  // the blocks find_block() checks first, and how often that was all it needed to do
+  int           lookaside[LOOKASIDE_BLOCKS];
+  int           lookaside_next;
+  unsigned long lookups;
+  unsigned long lookaside_hits;
+  
+  // cache statistics
+  // note that we can use the ref_count (below) - 1 as our total number of memory references
+  unsigned long cache_hits;
+  // writebacks can come from any thread when the cache is shared, but they're always misses so this is cheap
+  std::atomic<unsigned long> cache_writebacks;
+  // and the memory traffic they and the fills make, in words
+  std::atomic<unsigned long> words_filled;
+  std::atomic<unsigned long> words_written_back;
+  
+  // the stores that didn't change anything and the writebacks and bytes they saved, and the all
+  // zero lines brought in and written back
+  std::atomic<unsigned long> silent_stores;
+  std::atomic<unsigned long> silent_writebacks;
+  std::atomic<unsigned long> silent_bytes;
+  std::atomic<unsigned long> zero_fills;
+  std::atomic<unsigned long> zero_writebacks;
+  unsigned long sector_misses;
+  
+  // we have a reference count that monotonically increases to manage the LRU policy (defining the "age" of an entry)
+  // we change the entry's count every time it's accessed
+  // this value stores the next value to use
+  unsigned long current_ref_count;
+  
+  // replacement policy state -- see the replacement policy routines
+  ArcSet        arc_sets[CACHE_SETS];
+  unsigned long psel;                         // DIP's selector, with BIP winning above PSEL_MAX / 2
+  unsigned long bip_insertions;
+  unsigned long duel_windows[2];              // the windows LRU and BIP insertion were winning at the end of
+  unsigned long lead_changes;
+  unsigned long lead_history[DUEL_HISTORY];   // the accesses where the lead changed
+  bool          bip_leading;
+  unsigned char signatures[CODE_SIZE];        // SHiP's or Hawkeye's counter for each MOVE
+  unsigned long dead_predictions;             // misses whose block was predicted not to be reused
+  unsigned long cache_bypasses;
+  
+  // Hawkeye's OPTgen -- only allocated (as the one element) when we're using Hawkeye
+  vector<OptGen> optgen;
+  unsigned long  opt_hits;
+  unsigned long  opt_accesses;
+  
+  // how evenly the index function spreads the accesses over the sets
+  unsigned long set_accesses[CACHE_SETS];
+  unsigned long set_misses[CACHE_SETS];
+  unsigned long relocations;                  // blocks moved to make room under skewed ZCache placement
+  
+  // compression -- what the lines we brought in compressed to, and how full the cache was
+  unsigned long compressed_fills;
+  unsigned long compressed_bytes;
+  unsigned long lines_held;
+  unsigned long line_samples;                 // lines_held added up over every access
+  unsigned long growth_evictions;             // blocks evicted because a write made a line bigger
+  unsigned long decompression_cycles;
+  
+  // the DRAM behind the cache, when we're modelling it
+  Dram dram;
+  
+  // the cycles this machine spent waiting on the bus
+  unsigned long bus_stall_cycles;
+  
+  // which of the programs sharing the -Q cache model this machine is running
+  int qos_program;
+  
+  // a bit per memory block that's been written back, set by write_block() (from any thread)
+  std::atomic<unsigned long> modified_blocks[BITMAP_WORDS(DATA_SIZE)];
+  
+  // a copy of the data area as it was loaded, so we can tell which written back blocks really changed
+  alignas(STORAGE_ALIGN) uint16_t loaded_data[DATA_SIZE][BLOCK_SIZE];
+  
+  // how far we've run
+  unsigned long instruction_count;
+  unsigned long cycle_count;
+  unsigned long access_count;
+  int           exhausted_budget;
+  
+  // infinite loop detection -- see detect_loop()
+  unsigned long memory_generation;
+  unsigned long backward_branches;
+  LoopState     loop_state;
+  unsigned long loop_power;
+  unsigned long loop_length;
+  
+  // the phase to carry on with when we're interleaved with other machines
+  Phase phase;
+};
+
+typedef struct MACHINE Machine;
+
 // standard function pointer to run our control unit state machine
 typedef Phase (*process_phase)(void);
 
@@ -122,34 +874,100 @@ Phase write_back();
 ////////////////////////////////////////////////////////////////////
 // local variables
 
-// a count of branches so we can stop processing if we get an infinite loop
-static int branch_count = 0;
+// the limits on a run -- zero means unlimited
+static unsigned long budgets[NUM_BUDGETS] = { INSTRUCTION_LIMIT, 0, 0 };
+
+// what we dump at the end of a run
+static int dump_mode = DUMP_ALL;
+static unsigned short dump_start = 0;
+static unsigned short dump_end = DATA_WORDS - 1;
+static const char *image_filename = NULL;
+
+// how the cache picks blocks to replace and where new blocks go
+static int replacement_policy = POLICY_LRU;
+
+// whether blocks the PC-aware policies predict won't be reused skip the cache
+static bool bypass_dead_blocks = false;
+
+// how tags are mapped onto sets, and whether skewed placement can move blocks to make room
+static int index_function = INDEX_MODULO;
+static bool relocate_blocks = false;
+static int prime_sets = CACHE_SETS;
+
+// how cache lines are compressed
+static int compression = COMPRESSION_NONE;
+
+// whether there's a DRAM model behind the cache and how it manages its row buffers
+static int page_policy = PAGE_NONE;
+
+// the bytes a cycle the bus between the caches and memory carries -- 0 leaves it unlimited
+static int bus_width = 0;
+
+// the bus itself -- it's shared, so it lives outside the machines
+static Bus bus;
+
+// the rate SHARDS samples blocks at for the miss ratio curve (0 for no curve), and the most sampled
+// blocks it tracks before lowering the rate (0 to keep the rate fixed)
+static double mrc_rate = 0;
+static int    mrc_limit = 0;
+
+// the sampling itself -- the curve is only for single runs, so it lives outside the machines
+static Mrc mrc;
+
+// whether to sweep every set associative geometry in the one run, and the sweep itself
+static bool sweep = false;
+static Sweep sweep_state;
+
+// the hierarchies of lower levels to put under our cache, and our cache's fills and writebacks to
+// replay through them, each a tag shifted up with the bottom bit set for a writeback
+static vector<Hierarchy> hierarchies;
+static vector<unsigned short> miss_stream;
+
+// the direct mapped caches to simulate in lockstep alongside ours -- no lanes means none
+static Lockstep lockstep;
+
+// whether -m models the programs sharing one cache, the CAT masks given for them (empty to split
+// the ways evenly), and the model itself
+static bool share_cache = false;
+static vector<unsigned long> cat_masks;
+static Qos qos;
 
-// memory for our code and data
-static unsigned char code[CODE_SIZE][WORD_SIZE];
-// must reorganize memory to match our cache layout
-static unsigned char data[DATA_SIZE][BLOCK_SIZE][WORD_SIZE];
+// whether find_block() checks the last blocks it found first -- only with one thread, as it's per machine
+static bool use_lookaside = true;
 
-// our cache area
-static unsigned char data_cache[CACHE_BLOCKS][BLOCK_SIZE][WORD_SIZE];
-// the cache dictionary
-static CacheEntry dictionary[CACHE_BLOCKS];
+// whether we list the accesses and misses of every set at the end, along with how the lookaside did
+static bool show_sets = false;
 
-// cache statistics
-// note that we can use the ref_count (below) - 1 as our total number of memory references
-static unsigned long cache_hits = 0;
+// whether a store that leaves a word as it was keeps the block clean, and whether an all zero
+// line is written back as a flag instead of its data
+static bool eliminate_silent_stores = false;
+static bool track_zero_lines = false;
 
-// we have a reference count that monotonically increases to manage the LRU policy (defining the "age" of an entry)
-// we change the entry's count every time it's accessed
-// this value stores the next value to use
-static unsigned long current_ref_count = 1;
+// the words in each sector of a cache block -- with less than a block, misses only fill the
+// sector they need and only the words that were written are written back
+static int sector_size = BLOCK_SIZE;
 
-// our general purpose registers
-// NOTE: we let the registers match the host endianness so that the operations are easier -- all mapping occurs at the MDR
-static unsigned short registers[REGISTERS];
+// whether we report the memory traffic in words -- only when -s, -S or -Z could change it
+static bool show_traffic = false;
 
-// tracks what we're currently doing
-static State state;
+// when recording, every data access is buffered and written to this file
+static FILE *trace_file = NULL;
+static Access trace_buffer[TRACE_CHUNK];
+static int trace_count = 0;
+
+// the shared cache guards each set with its own lock, which also holds the set's LRU stamps
+static SetLock set_locks[CACHE_SETS];
+
+// the machine we normally run and the one we're currently working on
+// all of the routines below work on the current machine -- only run_jobs() ever changes it
+static Machine main_machine;
+static Machine *machine = &main_machine;
+
+// whether each phase prints what it's doing
+static bool show_phases = true;
+
+// when set, called after every data access the control unit makes
+static void (*access_observer)(const Access &access, bool hit) = NULL;
 
 // A list of handlers to process each state. Provides for a nice simple
 // state machine loop and is easily extended without using a huge
@@ -163,13 +981,13 @@ static process_phase control_unit[NUM_PHASES] =
 //////////////////////////////////////////////////////////////////////////
 // data extraction support routines
 
-#define opcode() ((Opcode)(state.IR[0] >> 5))
-#define mode()   ((state.IR[0] >> 2) & 0x07)
+#define opcode() ((Opcode)(machine->state.IR[0] >> 5))
+#define mode()   ((machine->state.IR[0] >> 2) & 0x07)
 
 // pulls a literal value from the 2nd operand of the current instruction
 char extract_literal()
 {
-  char value = (state.IR[1] & 0x3F);
+  char value = (machine->state.IR[1] & 0x3F);
   
   // sign extend if negative
   if ( value & 0x20 )
@@ -182,7 +1000,7 @@ char extract_literal()
 static unsigned char get_reg1()
 {
   unsigned char reg1 = 0xFF;
-  reg1 = ((state.IR[0]&0x03)<<2) | (state.IR[1]>>6);
+  reg1 = ((machine->state.IR[0]&0x03)<<2) | (machine->state.IR[1]>>6);
   reg1 &= 0x0F;
   
   return reg1;  
@@ -190,731 +1008,5601 @@ static unsigned char get_reg1()
 
 
 //////////////////////////////////////////////////////////////////////////
-// cache processing routines 
+// self profiling routines
+//
+// Each stage we time declares a profile_stage() at the top of its routine, which times it until it
+// returns. Stages nest, so the time for a stage includes anything it calls (cache_read() within
+// fetch_operands() for instance). Each thread gathers its own totals and adds them to the
+// overall totals when it exits, so replay threads are included too. Without -DPROFILE
+// profile_stage() expands to nothing.
 
+#ifdef PROFILE
 
-// writes a given block to memory and makes the cache block available for use
-void write_block(int block_id)
+static const char *stage_names[NUM_STAGES] =
 {
-  int i = dictionary[block_id].tag;
-  
-  // make sure it's valid first...
-  if (dictionary[block_id].valid)
-  {
-    // if it's dirty write the data
-    if (dictionary[block_id].dirty)
-    {
-      // write the block (with each element being a 2 byte word)
-      // note that the tag is our memory block identifier!
-      for (i = 0; i < BLOCK_SIZE; i++)
-      {
-        data[dictionary[block_id].tag][i][0] = data_cache[block_id][i][0];
-        data[dictionary[block_id].tag][i][1] = data_cache[block_id][i][1];
-      }
-    }
-    
-    // clear the dictionary
-    dictionary[block_id].valid = false;
-    dictionary[block_id].dirty = false;
-    dictionary[block_id].ref_count = 0;
-  }
-}
+  "fetch_instr", "decode_instr", "calculate_ea", "fetch_operands", "execute_instr", "write_back",
+  "find_block", "fetch_block", "removeLRU", "insert_data", "print_memory"
+};
+
+#ifdef PROFILE_COUNTERS
+static const char *counter_names[NUM_COUNTERS] =
+{
+  "cycles", "instructions", "LLC misses", "branch misses"
+};
+#endif
+
+// what we've gathered for each stage
+struct STAGE_PROFILE
+{
+  unsigned long calls[NUM_STAGES];
+  unsigned long ticks[NUM_STAGES];
+  unsigned long counters[NUM_STAGES][NUM_COUNTERS];
+};
 
+typedef struct STAGE_PROFILE StageProfile;
 
-// find the least recently used block and writes it back to main memory
-int removeLRU()
+static StageProfile profile_totals;
+static std::mutex profile_lock;
+
+// a thread's own totals, added into profile_totals when the thread finishes
+struct THREAD_PROFILE
 {
-  unsigned long LRU = 0xFFFFFFFF;
-  int i;
-  int block_id = 0;
+  StageProfile profile;
+  int counter_fds[NUM_COUNTERS];        // the first leads the group, -1 for any we couldn't open
+  unsigned long counter_ids[NUM_COUNTERS];  // the kernel's id for each, to match up a group read
   
-  // find the LRU block
-  for (i = 0; i < CACHE_BLOCKS; i++)
-  {
-    // make sure it's a valid block (should be redundant here...)
-    if (dictionary[i].valid)
-    {
-      if (dictionary[i].ref_count < LRU)
-      {
-        LRU = dictionary[i].ref_count;
-        block_id = i;
-      }
-    }
-  }
+  THREAD_PROFILE();
+  ~THREAD_PROFILE();
+};
+
+typedef struct THREAD_PROFILE ThreadProfile;
+
+static thread_local ThreadProfile thread_profile;
+
+// reads the cheapest timestamp the host has
+static inline unsigned long read_timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  unsigned long ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r" (ticks));
+  return ticks;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#ifdef PROFILE_COUNTERS
+// opens one counter for this thread, as part of the group if we have a leader
+static int open_counter(unsigned int type, unsigned long config, int group_fd)
+{
+  struct perf_event_attr attr;
   
-  // write it back to memory
-  write_block(block_id);
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group_fd == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
   
-  return block_id;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
 }
+#endif
 
-
-// pulls the given block from memory and places it into an available cache block
-int fetch_block(unsigned short tag)
+THREAD_PROFILE::THREAD_PROFILE()
 {
-  int i;
-  int block_id = 0;
-  bool found = false;
+  int counter;
   
-  // find the first free block -- keeping a pointer would be more efficient
-  for (i = 0; i < CACHE_BLOCKS && !found; i++)
+  memset(&profile, 0, sizeof(profile));
+  for (counter = 0; counter < NUM_COUNTERS; counter++)
   {
-    if (dictionary[i].valid == false)
-    {
-      block_id = i;
-      found = true;
-    }
+    counter_fds[counter] = -1;
+    counter_ids[counter] = 0;
   }
   
-  // if we didn't find a block, kill one
-  if (!found)
-    block_id = removeLRU();
+#ifdef PROFILE_COUNTERS
+  static const unsigned long configs[NUM_COUNTERS] =
+  {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
   
-  // load the required data
-  // note that the tag is our memory block identifier!
-  for (i = 0; i < BLOCK_SIZE; i++)
+  // if any but the leader fail, we just won't have that counter
+  for (counter = 0; counter < NUM_COUNTERS; counter++)
   {
-    data_cache[block_id][i][0] = data[tag][i][0];
-    data_cache[block_id][i][1] = data[tag][i][1];
+    counter_fds[counter] = open_counter(PERF_TYPE_HARDWARE, configs[counter], counter_fds[0]);
+    if (counter_fds[counter] != -1 && ioctl(counter_fds[counter], PERF_EVENT_IOC_ID, &counter_ids[counter]) == -1)
+    {
+      close(counter_fds[counter]);
+      counter_fds[counter] = -1;
+    }
+    if (counter_fds[0] == -1)
+      break;
   }
+  if (counter_fds[0] != -1)
+    ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+THREAD_PROFILE::~THREAD_PROFILE()
+{
+  int stage, counter;
   
-  // indicate that it's available
-  dictionary[block_id].valid = true;
-  dictionary[block_id].dirty = false;
-  dictionary[block_id].tag = tag;
+#ifdef PROFILE_COUNTERS
+  // the leader goes last, after the rest of its group
+  for (counter = NUM_COUNTERS - 1; counter >= 0; counter--)
+  {
+    if (counter_fds[counter] != -1)
+      close(counter_fds[counter]);
+  }
+#endif
   
-  return block_id;
+  std::lock_guard<std::mutex> guard(profile_lock);
+  for (stage = 0; stage < NUM_STAGES; stage++)
+  {
+    profile_totals.calls[stage] += profile.calls[stage];
+    profile_totals.ticks[stage] += profile.ticks[stage];
+    for (counter = 0; counter < NUM_COUNTERS; counter++)
+      profile_totals.counters[stage][counter] += profile.counters[stage][counter];
+  }
 }
 
-
-// looks for the tag in the dictionary and sets the block id if found
-bool find_block(unsigned long tag, int &block_id)
+// reads this thread's hardware counters, leaving them at zero if we don't have any
+static inline void read_counters(unsigned long counters[NUM_COUNTERS])
 {
-  bool found = false;
-  int i;
+#ifdef PROFILE_COUNTERS
+  // the group read gives us the number of counters followed by each value and its id -- counters
+  // that failed to open are missing, so the ids say which slot each value belongs in
+  unsigned long values[1 + NUM_COUNTERS * 2] = {};
+  unsigned long i;
+  int counter;
   
-  // simple linear search...
-  for (i = 0; i < CACHE_BLOCKS && !found; i++)
+  if (thread_profile.counter_fds[0] != -1 && read(thread_profile.counter_fds[0], values, sizeof(values)) > 0)
   {
-    // make sure it's valid first!
-    if (dictionary[i].valid)
+    memset(counters, 0, sizeof(unsigned long) * NUM_COUNTERS);
+    for (i = 0; i < values[0] && i < NUM_COUNTERS; i++)
     {
-      if (dictionary[i].tag == tag)
+      for (counter = 0; counter < NUM_COUNTERS; counter++)
       {
-        block_id = i;
-        found = true;
+        if (thread_profile.counter_fds[counter] != -1 && thread_profile.counter_ids[counter] == values[2 + i * 2])
+          counters[counter] = values[1 + i * 2];
       }
     }
+    return;
   }
-  
-  return found;
+#endif
+  memset(counters, 0, sizeof(unsigned long) * NUM_COUNTERS);
 }
 
-
-// write the data (wrt the MAR/MDR) into the cache, fetching the block if required
-Phase cache_write()
+// times a stage from its construction until it goes out of scope
+class StageTimer
 {
-  Phase rc = FETCH_INSTR;
-  unsigned long tag = addr2tag(state.MAR);
-  unsigned short offset = addr2offset(state.MAR);
-  int block_id;
+public:
+  StageTimer(int stage) : stage(stage)
+  {
+    read_counters(start_counters);
+    start = read_timestamp();
+  }
   
-  // make sure it's in range
-  // must adjust the data size back up to a byte based value -- it's now in blocks...
-  if (state.MAR < (DATA_SIZE * BLOCK_SIZE * 2))
+  ~StageTimer()
   {
-    // if the block isn't in the cache, put it in
-    if (!find_block(tag, block_id))
-      block_id = fetch_block(tag);
-    
-    // we have a cache hit!
-    else
-      cache_hits++;
-    
-    // write the word
-    data_cache[block_id][offset][0] = state.MDR >> 8;
-    data_cache[block_id][offset][1] = state.MDR & 0x00ff;
+    unsigned long ticks = read_timestamp() - start;
+    unsigned long counters[NUM_COUNTERS];
+    int counter;
     
-    // up the block's reference count
-    dictionary[block_id].ref_count = current_ref_count++;
-    
-    // indicate that it has data to return to memory
-    dictionary[block_id].dirty = true;
+    read_counters(counters);
+    thread_profile.profile.calls[stage]++;
+    thread_profile.profile.ticks[stage] += ticks;
+    for (counter = 0; counter < NUM_COUNTERS; counter++)
+      thread_profile.profile.counters[stage][counter] += counters[counter] - start_counters[counter];
   }
-  else
-    rc = ILLEGAL_ADDRESS;
   
-  return rc;
-}
+private:
+  int           stage;
+  unsigned long start;
+  unsigned long start_counters[NUM_COUNTERS];
+};
 
-// read in the data from the cache and fetch from memory as required
-Phase cache_read()
+#define profile_stage( stage ) StageTimer stage_timer( stage )
+
+// prints what we've gathered so far for each stage
+void print_profile()
 {
-  Phase rc = WRITE_BACK;
-  unsigned long tag = addr2tag(state.MAR);
-  unsigned short offset = addr2offset(state.MAR);
-  int block_id;
+  StageProfile totals;
+  bool show_counters = false;
+  int stage, counter;
   
-  // make sure it's in range
-  // must adjust the data size back up to a byte based value -- it's now in blocks...
-  if (state.MAR < (DATA_SIZE * BLOCK_SIZE * 2))
+  // the current thread hasn't finished yet, so add it in ourselves
+  std::lock_guard<std::mutex> guard(profile_lock);
+  totals = profile_totals;
+  for (stage = 0; stage < NUM_STAGES; stage++)
   {
-    // if the block isn't in the cache, put it in
-    if (!find_block(tag, block_id))
-      block_id = fetch_block(tag);
-    
-    // we have a cache hit!
-    else
-      cache_hits++;
-    
-    // read the word
-    // map our data assuming that we have big endian coming in
-    state.MDR = data_cache[block_id][offset][0];
-    state.MDR <<= 8;
-    state.MDR |= data_cache[block_id][offset][1];
-    
-    // up the block's reference count
-    dictionary[block_id].ref_count = current_ref_count++;
+    totals.calls[stage] += thread_profile.profile.calls[stage];
+    totals.ticks[stage] += thread_profile.profile.ticks[stage];
+    for (counter = 0; counter < NUM_COUNTERS; counter++)
+      totals.counters[stage][counter] += thread_profile.profile.counters[stage][counter];
   }
-  else
-    rc = ILLEGAL_ADDRESS;
   
-  return rc;
+  printf("Simulator profile (times include any stages called):\n");
+#ifdef PROFILE_COUNTERS
+  // we may not be allowed to use the counters (see perf_event_paranoid)
+  show_counters = (thread_profile.counter_fds[0] != -1);
+  if (!show_counters)
+    printf("Hardware performance counters are unavailable.\n");
+#endif
+  printf("%-16s %12s %16s %12s", "stage", "calls", "ticks", "ticks/call");
+#ifdef PROFILE_COUNTERS
+  for (counter = 0; counter < NUM_COUNTERS && show_counters; counter++)
+    printf(" %16s", counter_names[counter]);
+#endif
+  printf("\n");
+  
+  for (stage = 0; stage < NUM_STAGES; stage++)
+  {
+    if (totals.calls[stage] == 0)
+      continue;
+    
+    printf("%-16s %12ld %16ld %12.1f", stage_names[stage], totals.calls[stage], totals.ticks[stage],
+           (double)totals.ticks[stage] / (double)totals.calls[stage]);
+    for (counter = 0; counter < NUM_COUNTERS && show_counters; counter++)
+    {
+      if (thread_profile.counter_fds[counter] != -1)
+        printf(" %16ld", totals.counters[stage][counter]);
+      else
+        printf(" %16s", "-");
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+#else
+
+#define profile_stage( stage )
+
+static inline void print_profile()
+{
 }
 
+#endif
+
+
 //////////////////////////////////////////////////////////////////////////
-// state processing routines -- note that they all have the same prototype
+// set index routines
+//
+// Taking the low bits of the tag as the set means that a program striding through memory by a
+// power of two only ever uses a few of the sets. Folding the upper bits of the tag in with XOR, or
+// taking the tag modulo a prime number of sets (leaving the sets above it unused), spreads those
+// strides out. A skewed-associative cache goes further and gives each way its own hash, so blocks
+// that conflict in one way are unlikely to conflict in the others. Block i of the dictionary is
+// still way i % CACHE_WAYS of row i / CACHE_WAYS, but a row is no longer a set: a block can go in a
+// different row in each way. With ZCache relocation, a miss also looks at where the blocks in
+// those places could move to in their other ways, and makes room by moving one of them along.
 
-// simply pulls the instruction from code memory, verifying the address first
-Phase fetch_instr()
+static const char *index_names[NUM_INDEX_FUNCTIONS] =
 {
-  Phase rc = DECODE_INSTR;
+  "mod", "xor", "prime", "skew"
+};
+
+// the number of bits needed for a set number, folding the tag this many bits at a time
+static constexpr int log2_floor(unsigned long value)
+{
+  return value < 2 ? 0 : 1 + log2_floor(value / 2);
+}
+
+#define SET_BITS      log2_floor(CACHE_SETS)
+
+// the largest prime number of sets we can use, or 1 if we only have the one set
+static int largest_prime(int sets)
+{
+  int divisor;
   
-  // make sure it's in range
-  if (state.PC < CODE_SIZE)
+  for (; sets > 2; sets--)
   {
-    // using the MAR/MDR seems really weird here since you can just use the PC to index code[]
-    // but, we have to do it the way the CPU would handle things...
-    state.MAR = state.PC;
-    state.MDR = code[state.MAR][0];
-    state.MDR <<= 8;
-    state.MDR |= code[state.MAR][1];
-    
-    state.IR[0] = (unsigned char)(state.MDR >> 8);
-    state.IR[1] = (unsigned char)(state.MDR & 0x00ff);
-
-    printf("FETCH_INSTR: PC=%04x, IR=%02x%02x\n", state.PC, state.IR[0], state.IR[1]);
+    for (divisor = 2; divisor * divisor <= sets && sets % divisor; divisor++)
+      ;
+    if (divisor * divisor > sets)
+      break;
   }
-  else
-    rc = ILLEGAL_ADDRESS;
   
-  return rc;
+  return sets;
 }
 
-// pulls the opcode and addressing mode and verifies that the instruction is valid.
-// uses the instruction characterization to decide where to go next.
-Phase decode_instr()
+// the row a tag goes in for one of the ways of a skewed cache
+static inline int skew_set(unsigned long tag, int way)
 {
-  Phase rc = FETCH_OPERANDS;
+  unsigned long hash = (tag ^ (way * 0x9E3779B97F4A7C15UL)) * 0xBF58476D1CE4E5B9UL;
   
-  printf("DECODE_INSTR: IR=%02x%02x, Opcode=%d, Mode=%d\n", state.IR[0], state.IR[1], opcode(), mode());
+  hash ^= hash >> 31;
+  return (int)(hash % CACHE_SETS);
+}
+
+// the set a tag goes in -- for a skewed cache, its row in the first way
+static inline int index_set(unsigned long tag)
+{
+  unsigned long folded = 0;
   
-  // validate the instruction before continuing
-  switch (opcode())
+  if (CACHE_SETS == 1)
+    return 0;
+  
+  switch (index_function)
   {
-    // valid modes are 000b and 001b
-    case ADD_OPCODE:
-    case SUB_OPCODE:
-    case AND_OPCODE:
-    case OR_OPCODE:
-    case XOR_OPCODE:
-    case SHIFT_OPCODE:
-      if (mode() > 1)
-        rc = ILLEGAL_OPCODE;
-      break;
+    case INDEX_XOR:
+      for (; tag; tag >>= SET_BITS)
+        folded ^= tag;
+      return (int)(folded % CACHE_SETS);
       
-    // invalid mode if the second bit is set
-    case MOVE_OPCODE:
-      if (mode() & 0x02)
-        rc = ILLEGAL_OPCODE;
-      else
-        rc = CALCULATE_EA;
-      break;
+    case INDEX_PRIME:
+      return (int)(tag % prime_sets);
       
-    // invalid mode if all 3 bits are set
-    case BRANCH_OPCODE:
-      if (mode() == 0x07)
-        rc = ILLEGAL_OPCODE;
-      break;
+    case INDEX_SKEW:
+      return skew_set(tag, 0);
       
-    // all other opcode values are invalid  
     default:
-      rc = ILLEGAL_OPCODE;
-      break;
+      return (int)(tag % CACHE_SETS);
   }
-  
-  return rc;
 }
 
-// effective address calculations are only required if we have to access memory
-// with the address placed in the MAR
-Phase calculate_ea()
+// counts an access against the row it ended up in
+// each row is only ever touched by one thread at a time, even when the cache is shared
+static inline void count_set_access(int row, bool hit)
 {
-  Phase rc = FETCH_OPERANDS;
-  unsigned char reg = 0xFF;
-  
-  // the first operand has our memory address
-  if (mode() & 0x04)
-  {
-    reg = get_reg1();
-  }
-  
-  // the second operand has our memory address
-  else if (mode() & 0x01)
-  {
-    reg = state.IR[1] >> 2;
-    reg &= 0x0F;
-  }
+  machine->set_accesses[row]++;
+  if (!hit)
+    machine->set_misses[row]++;
+}
+
+// prints the smallest, average and largest of a count over the sets and how much it varies
+static void print_set_spread(const char *what, const unsigned long *counts)
+{
+  unsigned long low = ULONG_MAX, high = 0;
+  double mean = 0, variance = 0;
+  int set;
   
-  // load the address if we have a valid register
-  if (reg != 0xFF)
+  for (set = 0; set < CACHE_SETS; set++)
   {
-    state.MAR = registers[reg];
+    low = std::min(low, counts[set]);
+    high = std::max(high, counts[set]);
+    mean += counts[set];
   }
-
-  printf("CALCULATE_EA: MAR=%04x, Reg=%d\n", state.MAR, reg);
+  mean /= CACHE_SETS;
+  for (set = 0; set < CACHE_SETS; set++)
+    variance += (counts[set] - mean) * (counts[set] - mean);
+  variance /= CACHE_SETS;
   
-  return rc;
+  printf("%s per set: smallest %ld, average %.1f, largest %ld, coefficient of variation %4.3f.\n",
+         what, low, mean, high, mean > 0 ? sqrt(variance) / mean : 0.0);
 }
 
-// uses the instruction and addressing mode to decide how to get the data
-Phase fetch_operands()
+// reports how the accesses and misses were spread over the sets, listing them if asked to
+void print_set_usage()
 {
-  Phase rc = EXECUTE_INSTR;
-  unsigned char reg;
+  int set;
   
-  // operand 1 is always register contents...
-  // unless it's a MOVE, then it's a destination and doesn't need fetching
-  if (opcode() != MOVE_OPCODE)
-  {
-    reg = get_reg1();
-    state.ALU_x = registers[reg];
-  }
+  if (CACHE_SETS < 2)
+    return;
   
-  // operand 2 is more complicated...
+  printf("Sets were indexed by %s%s.\n", index_names[index_function],
+         index_function == INDEX_SKEW && relocate_blocks ? " with relocation" : "");
+  if (index_function == INDEX_SKEW)
+    printf("%ld blocks were relocated to make room.\n", machine->relocations);
+  print_set_spread("Accesses", machine->set_accesses);
+  print_set_spread("Misses", machine->set_misses);
   
-  // calculate a register value in case we need it
-  reg = state.IR[1] >> 2;
-  reg &= 0x0F;
-  switch (opcode())
+  if (show_sets)
   {
-    // depending on the mode, put register contents or the literal into the "register"
-    case ADD_OPCODE:
-    case SUB_OPCODE:
-    case AND_OPCODE:
-    case OR_OPCODE:
-    case XOR_OPCODE:
-      if (mode() == 0)
-        state.ALU_y = extract_literal();
-      else
-        state.ALU_y = registers[reg];
-      break;
-      
-    // to simplify things we always put the data into the MDR, even for a literal to
-    // register transfer. 
-    case MOVE_OPCODE:
-      // no need to execute an instruction here
-      rc = WRITE_BACK;
-      
-      // copy in the literal or register contents
-      if ((mode() & 0x01) == 0)
-        state.MDR = extract_literal();
-      else if (mode() & 0x04)
-        state.MDR = registers[reg];
-      
-      // otherwise, fetch from memory
-      else
-        rc = cache_read();
-      
-      break;
-      
-    // branches always have a literal, ignored for jumps...  
-    case BRANCH_OPCODE:
-      state.ALU_y = extract_literal();
-      break;
-      
-    default:
-      break;
+    printf("%6s %12s %12s\n", "set", "accesses", "misses");
+    for (set = 0; set < CACHE_SETS; set++)
+      printf("%6d %12ld %12ld\n", set, machine->set_accesses[set], machine->set_misses[set]);
   }
+  printf("\n");
+}
+
+//////////////////////////////////////////////////////////////////////////
+// cache compression routines
+//
+// A compressed cache has COMPRESSION_TAGS tags for each line's worth of data in a set, so the
+// CACHE_WAYS tags of a set share the data space of CACHE_WAYS / COMPRESSION_TAGS uncompressed
+// lines. Each line takes up however many bytes its words compress to, and a set holds as many
+// lines as fit. Lines are sized when they're brought in and again whenever they're written, which
+// can make them grow and push other lines out. Hits on compressed lines pay a decompression latency.
+//
+// Base-Delta-Immediate sees a line as a run of 2, 4 or 8 byte values and stores one base and a
+// small delta for each value, from either the base or zero. Frequent pattern compression looks at
+// each 32 bit word on its own and stores it with a 3 bit prefix saying which of a few common
+// patterns (zeros, small sign extended values, repeated bytes...) it matches.
+
+static const char *compression_names[NUM_COMPRESSION_ALGORITHMS] =
+{
+  "none", "bdi", "fpc"
+};
 
-  printf("FETCH_OPERANDS: ALU_x=%04x, ALU_y=%04x, MDR=%04x\n", state.ALU_x, state.ALU_y, state.MDR);
+// sign extends the low bytes of a value
+static inline int64_t sign_extend(uint64_t value, int bytes)
+{
+  int shift = 64 - bytes * 8;
   
-  return rc;
+  return (int64_t)(value << shift) >> shift;
 }
 
-// based on the opcode, performs the operation on the ALU inputs
-Phase execute_instr()
+// returns true if the value fits in a signed delta of the given number of bytes
+static inline bool fits_delta(int64_t value, int bytes)
 {
-  Phase rc = WRITE_BACK;
+  return value >= -(1L << (bytes * 8 - 1)) && value < (1L << (bytes * 8 - 1));
+}
+
+// the bytes a line takes up with Base-Delta-Immediate
+// memory is big endian, so each value is made of its words with the first at the top
+int bdi_size(const uint16_t *words)
+{
+  uint64_t values[BLOCK_SIZE];
+  uint64_t base = 0;
+  int best = LINE_BYTES;
+  int base_bytes, delta_bytes;
+  int count, i, j;
+  bool zeros = true, repeated, has_base, fits;
   
-  printf("EXECUTE_INSTR: Opcode=%d, ALU_x=%04x, ALU_y=%04x\n", opcode(), state.ALU_x, state.ALU_y);
+  for (i = 0; i < BLOCK_SIZE; i++)
+    zeros = zeros && words[i] == 0;
+  if (zeros)
+    return 1;
   
-  switch (opcode())
+  for (base_bytes = 8; base_bytes >= WORD_SIZE; base_bytes /= 2)
   {
-    case ADD_OPCODE:
-      state.ALU_z = (short)state.ALU_x + (short)state.ALU_y;
-      break;
-      
-    case SUB_OPCODE:
-      state.ALU_z = (short)state.ALU_x - (short)state.ALU_y;
+    if (LINE_BYTES % base_bytes)
+      continue;
+    
+    count = LINE_BYTES / base_bytes;
+    repeated = true;
+    for (i = 0; i < count; i++)
+    {
+      values[i] = 0;
+      for (j = 0; j < base_bytes / WORD_SIZE; j++)
+        values[i] = (values[i] << 16) | words[i * base_bytes / WORD_SIZE + j];
+      repeated = repeated && values[i] == values[0];
+    }
+    if (repeated)
+      best = std::min(best, base_bytes);
+    
+    for (delta_bytes = 1; delta_bytes < base_bytes; delta_bytes *= 2)
+    {
+      has_base = false;
+      fits = true;
+      for (i = 0; i < count && fits; i++)
+      {
+        // the value is either a small immediate or close to the base, which is the first value that isn't
+        if (fits_delta(sign_extend(values[i], base_bytes), delta_bytes))
+          continue;
+        if (!has_base)
+        {
+          base = values[i];
+          has_base = true;
+        }
+        fits = fits_delta(sign_extend(values[i] - base, base_bytes), delta_bytes);
+      }
+      
+      // a base, the deltas and a bit for each saying which base it's from
+      if (fits)
+        best = std::min(best, base_bytes + count * delta_bytes + (count + 7) / 8);
+    }
+  }
+  
+  return best;
+}
+
+// the bytes a line takes up with frequent pattern compression
+int fpc_size(const uint16_t *words)
+{
+  int bits = 0;
+  int zeros = 0;
+  int i;
+  
+  for (i = 0; i < BLOCK_SIZE; i += 2)
+  {
+    uint32_t word = ((uint32_t)words[i] << 16) | (i + 1 < BLOCK_SIZE ? words[i + 1] : 0);
+    int32_t value = (int32_t)word;
+    
+    // runs of up to 8 zero words share a prefix and a count
+    if (word == 0)
+    {
+      if (zeros++ % 8 == 0)
+        bits += 3 + 3;
+      continue;
+    }
+    zeros = 0;
+    
+    if (value >= -8 && value < 8)
+      bits += 3 + 4;
+    else if (value >= -128 && value < 128)
+      bits += 3 + 8;
+    else if (value >= -32768 && value < 32768)
+      bits += 3 + 16;
+    // the low half is zero, or each half is a sign extended byte
+    else if ((word & 0xffff) == 0 ||
+             (fits_delta((int16_t)(word >> 16), 1) && fits_delta((int16_t)(word & 0xffff), 1)))
+      bits += 3 + 16;
+    else if (word == (word & 0xff) * 0x01010101U)
+      bits += 3 + 8;
+    else
+      bits += 3 + 32;
+  }
+  
+  return std::min((bits + 7) / 8, LINE_BYTES);
+}
+
+// the bytes a line takes up in the cache
+int compressed_size(const uint16_t *words)
+{
+  if (compression == COMPRESSION_BDI)
+    return bdi_size(words);
+  if (compression == COMPRESSION_FPC)
+    return fpc_size(words);
+  
+  return LINE_BYTES;
+}
+
+// the bytes taken up by the lines in a set
+static int set_bytes(int set)
+{
+  int bytes = 0;
+  int i;
+  
+  for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS; i++)
+  {
+    if (machine->dictionary[i].valid)
+      bytes += machine->dictionary[i].size;
+  }
+  
+  return bytes;
+}
+
+// reports how well the lines compressed and how many more of them the cache held for it
+void print_compression_statistics()
+{
+  double data_lines = (double)CACHE_SETS * SET_BYTES / LINE_BYTES;
+  double lines = machine->current_ref_count > 1 ? (double)machine->line_samples / (machine->current_ref_count - 1) : 0.0;
+  
+  if (compression == COMPRESSION_NONE)
+    return;
+  
+  printf("Lines compressed with %s to an average of %.1f of %d bytes, a compression ratio of %4.3f.\n",
+         compression_names[compression], machine->compressed_fills ? (double)machine->compressed_bytes / machine->compressed_fills : 0.0,
+         LINE_BYTES, machine->compressed_bytes ? (double)machine->compressed_fills * LINE_BYTES / machine->compressed_bytes : 0.0);
+  printf("The cache held an average of %.1f lines in the space of %.0f, an effective capacity of %4.3f times.\n",
+         lines, data_lines, lines / data_lines);
+  printf("%ld blocks were evicted when writes made lines grow, and decompression took %ld cycles.\n\n",
+         machine->growth_evictions, machine->decompression_cycles);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// replacement policy routines
+//
+// LRU is kept with reference counts: every access stamps its block and the smallest stamp in a
+// set is replaced. That thrashes on loops over more blocks than a set holds, since every block is
+// evicted just before it's needed again. The other policies tackle that in two ways.
+//
+// BIP inserts most new blocks at the LRU position by giving them the stamp of the block they
+// replace, so a scan churns through one way while the rest of the set holds on to its blocks.
+// DIP chooses between LRU and BIP insertion with set dueling: a few leader sets always use one or
+// the other, their misses move a saturating selector, and the remaining follower sets insert the
+// way the leaders that are missing less do.
+//
+// ARC splits each set between blocks seen once (T1) and blocks seen again (T2), and remembers
+// the tags it recently evicted from each (B1 and B2). A miss on one of those ghosts means its
+// list was evicted too eagerly, so ARC moves its target for the size of T1 towards that list.
+//
+// SHiP and Hawkeye use the PC of the MOVE making each access. Every block carries a re-reference
+// prediction value (RRPV) and the block predicted to be used furthest in the future goes. Each MOVE
+// has a saturating counter that predicts whether the blocks it brings in will be reused: SHiP counts
+// up when one of them hits and down when one is evicted without having been reused, while Hawkeye
+// runs OPTgen over the recent accesses to each set to work out whether Belady's OPT would have
+// kept the block, and trains the counter of the MOVE that last used it on the answer. Blocks
+// predicted not to be reused go in at the maximum RRPV, or with -y skip the cache altogether.
+
+static const char *policy_names[NUM_POLICIES] =
+{
+  "lru", "bip", "dip", "arc", "ship", "hawkeye"
+};
+
+// works out a set's part in the duel
+static inline int duel_role(int set)
+{
+  if (set % DUEL_SPACING == 0)
+    return DUEL_LRU_LEADER;
+  if (set % DUEL_SPACING == 1)
+    return DUEL_BIP_LEADER;
+  
+  return DUEL_FOLLOWER;
+}
+
+// bimodal insertion -- all but one new block in BIP_THROTTLE go in at the LRU position
+static inline bool bimodal_insert_at_lru()
+{
+  return ++machine->bip_insertions % BIP_THROTTLE != 0;
+}
+
+// decides whether a block being brought into the set goes in at the LRU position
+// DIP's leader sets count their misses here
+bool insert_at_lru(int set)
+{
+  if (replacement_policy == POLICY_BIP)
+    return bimodal_insert_at_lru();
+  
+  if (replacement_policy == POLICY_DIP)
+  {
+    switch (duel_role(set))
+    {
+      case DUEL_LRU_LEADER:
+        if (machine->psel < PSEL_MAX)
+          machine->psel++;
+        return false;
+        
+      case DUEL_BIP_LEADER:
+        if (machine->psel > 0)
+          machine->psel--;
+        return bimodal_insert_at_lru();
+        
+      default:
+        return machine->psel > PSEL_MAX / 2 && bimodal_insert_at_lru();
+    }
+  }
+  
+  return false;
+}
+
+// notes who's winning the duel at the end of each window of accesses
+void tally_duel()
+{
+  bool bip_leading = machine->psel > PSEL_MAX / 2;
+  
+  machine->duel_windows[bip_leading]++;
+  if (bip_leading != machine->bip_leading)
+  {
+    if (machine->lead_changes < DUEL_HISTORY)
+      machine->lead_history[machine->lead_changes] = machine->current_ref_count - 1;
+    machine->lead_changes++;
+    machine->bip_leading = bip_leading;
+  }
+}
+
+// counts the set's blocks (ARC_T1 or ARC_T2) or ghosts (ARC_B1 or ARC_B2) on a list
+static int arc_count(int set, int list)
+{
+  int count = 0;
+  int i;
+  
+  if (list == ARC_T1 || list == ARC_T2)
+  {
+    for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS; i++)
+      count += machine->dictionary[i].valid && machine->dictionary[i].list == list;
+  }
+  else
+  {
+    for (i = 0; i < CACHE_WAYS; i++)
+      count += machine->arc_sets[set].ghosts[i].valid && machine->arc_sets[set].ghosts[i].list == list;
+  }
+  
+  return count;
+}
+
+// finds the least recently used block on a list, returning -1 if it's empty
+static int arc_lru_block(int set, int list)
+{
+  int block_id = -1;
+  int i;
+  
+  for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS; i++)
+  {
+    if (machine->dictionary[i].valid && machine->dictionary[i].list == list &&
+        (block_id == -1 || machine->dictionary[i].ref_count < machine->dictionary[block_id].ref_count))
+      block_id = i;
+  }
+  
+  return block_id;
+}
+
+// forgets the oldest ghost on a list
+static void arc_forget(int set, int list)
+{
+  GhostEntry *ghosts = machine->arc_sets[set].ghosts;
+  int oldest = -1;
+  int i;
+  
+  for (i = 0; i < CACHE_WAYS; i++)
+  {
+    if (ghosts[i].valid && ghosts[i].list == list && (oldest == -1 || ghosts[i].ref_count < ghosts[oldest].ref_count))
+      oldest = i;
+  }
+  
+  if (oldest != -1)
+    ghosts[oldest].valid = false;
+}
+
+// ARC's handling of a miss before any block is replaced
+// returns where the tag was found (ARC_B1 or ARC_B2), or ARC_T1 if ARC has never seen it
+int arc_miss(int set, unsigned short tag)
+{
+  ArcSet &arc = machine->arc_sets[set];
+  int found = -1;
+  int t1, t2, b1, b2;
+  int i;
+  
+  for (i = 0; i < CACHE_WAYS && found == -1; i++)
+  {
+    if (arc.ghosts[i].valid && arc.ghosts[i].tag == tag)
+      found = i;
+  }
+  
+  t1 = arc_count(set, ARC_T1);
+  t2 = arc_count(set, ARC_T2);
+  b1 = arc_count(set, ARC_B1);
+  b2 = arc_count(set, ARC_B2);
+  
+  // a ghost moves the target towards its list, by more the smaller that list is
+  if (found != -1)
+  {
+    if (arc.ghosts[found].list == ARC_B1)
+      arc.target = std::min(CACHE_WAYS, arc.target + std::max(b2 / b1, 1));
+    else
+      arc.target = std::max(0, arc.target - std::max(b1 / b2, 1));
+    
+    arc.ghosts[found].valid = false;
+    return arc.ghosts[found].list;
+  }
+  
+  // otherwise keep T1 and B1 to a set's worth of tags, and everything to two sets' worth
+  if (t1 + b1 == CACHE_WAYS)
+  {
+    if (t1 < CACHE_WAYS)
+      arc_forget(set, ARC_B1);
+  }
+  else if (t1 + t2 + b1 + b2 >= 2 * CACHE_WAYS)
+    arc_forget(set, ARC_B2);
+  
+  return ARC_T1;
+}
+
+// ARC's choice of block to replace, remembering it as a ghost
+// history is what arc_miss() returned for the block we're making room for
+int arc_victim(int set, int history)
+{
+  ArcSet &arc = machine->arc_sets[set];
+  int t1 = arc_count(set, ARC_T1);
+  int block_id;
+  int ghost = 0;
+  int i;
+  
+  // when T1 fills the set it has no ghosts, so its oldest block just goes
+  if (history == ARC_T1 && t1 == CACHE_WAYS)
+    return arc_lru_block(set, ARC_T1);
+  
+  if (t1 > 0 && (t1 > arc.target || (history == ARC_B2 && t1 == arc.target)))
+    block_id = arc_lru_block(set, ARC_T1);
+  else if ((block_id = arc_lru_block(set, ARC_T2)) == -1)
+    block_id = arc_lru_block(set, ARC_T1);
+  
+  // take a free ghost -- there should always be one, but otherwise the oldest
+  for (i = 0; i < CACHE_WAYS && arc.ghosts[ghost].valid; i++)
+  {
+    if (!arc.ghosts[i].valid || arc.ghosts[i].ref_count < arc.ghosts[ghost].ref_count)
+      ghost = i;
+  }
+  
+  arc.ghosts[ghost].valid = true;
+  arc.ghosts[ghost].list = machine->dictionary[block_id].list == ARC_T1 ? ARC_B1 : ARC_B2;
+  arc.ghosts[ghost].tag = machine->dictionary[block_id].tag;
+  arc.ghosts[ghost].ref_count = machine->current_ref_count;
+  
+  return block_id;
+}
+
+// returns true if the PC-aware policy predicts that blocks used by the MOVE won't be reused
+static inline bool predicted_dead(unsigned short pc)
+{
+  if (replacement_policy == POLICY_SHIP)
+    return machine->signatures[pc % CODE_SIZE] == 0;
+  if (replacement_policy == POLICY_HAWKEYE)
+    return machine->signatures[pc % CODE_SIZE] < HAWKEYE_FRIENDLY;
+  
+  return false;
+}
+
+// moves a MOVE's counter towards predicting reuse or not
+static inline void train_signature(unsigned short pc, bool reused)
+{
+  unsigned char &counter = machine->signatures[pc % CODE_SIZE];
+  
+  if (reused && counter < SIGNATURE_MAX)
+    counter++;
+  else if (!reused && counter > 0)
+    counter--;
+}
+
+// decides whether a missing block skips the cache and goes straight to memory
+bool bypass_block(unsigned short pc)
+{
+  if (!predicted_dead(pc))
+    return false;
+  
+  machine->dead_predictions++;
+  if (!bypass_dead_blocks)
+    return false;
+  
+  // SHiP only learns from blocks it brings in, so it lets one in every BIP_THROTTLE in anyway
+  if (replacement_policy == POLICY_SHIP && machine->dead_predictions % BIP_THROTTLE == 0)
+    return false;
+  
+  machine->cache_bypasses++;
+  return true;
+}
+
+// Hawkeye's OPTgen: works out whether OPT would have hit on this access to the set, and trains
+// the MOVE that last used the block on the answer
+// OPT keeps a block from one use to the next if the set never held more than CACHE_WAYS blocks in between
+void optgen_access(int set, unsigned short tag, unsigned short pc)
+{
+  OptGen &optgen = machine->optgen[0];
+  unsigned long now = ++optgen.set_clock[set];
+  unsigned long last = optgen.block_clock[tag];
+  unsigned long tick;
+  bool fits = false;
+  
+  // this tick starts out holding nothing
+  optgen.occupancy[set][now % OPTGEN_LENGTH] = 0;
+  
+  if (last)
+  {
+    if (now - last < OPTGEN_LENGTH)
+    {
+      fits = true;
+      for (tick = last; tick < now && fits; tick++)
+        fits = optgen.occupancy[set][tick % OPTGEN_LENGTH] < CACHE_WAYS;
+  
+      // OPT would have held it all the way through
+      if (fits)
+      {
+        for (tick = last; tick < now; tick++)
+          optgen.occupancy[set][tick % OPTGEN_LENGTH]++;
+        machine->opt_hits++;
+      }
+    }
+  
+    train_signature(optgen.block_pc[tag], fits);
+  }
+  
+  machine->opt_accesses++;
+  optgen.block_clock[tag] = now;
+  optgen.block_pc[tag] = pc;
+}
+
+// SHiP's and Hawkeye's choice of block to replace -- the one predicted to be used furthest away,
+// ageing the set until there's one at the maximum
+int rrip_victim(int set)
+{
+  int rrpv_max = replacement_policy == POLICY_SHIP ? SHIP_RRPV_MAX : HAWKEYE_RRPV_MAX;
+  int first = set * CACHE_WAYS;
+  int block_id = first;
+  int i;
+  
+  for (i = first + 1; i < first + CACHE_WAYS; i++)
+  {
+    if (machine->dictionary[i].rrpv > machine->dictionary[block_id].rrpv)
+      block_id = i;
+  }
+  
+  CacheEntry &victim = machine->dictionary[block_id];
+  if (replacement_policy == POLICY_SHIP)
+  {
+    // SHiP ages everything along with the victim, so the rest of the set stays in order
+    for (i = first; i < first + CACHE_WAYS; i++)
+      machine->dictionary[i].rrpv += rrpv_max - victim.rrpv;
+  
+    // it was brought in for nothing
+    if (!victim.reused)
+      train_signature(victim.pc, false);
+  }
+  // Hawkeye evicting a block it expected to be reused means the prediction was wrong
+  else if (victim.rrpv < rrpv_max)
+    train_signature(victim.pc, false);
+  
+  return block_id;
+}
+
+// sets the prediction for a block that's just been brought in
+void rrip_insert(int block_id, unsigned short pc)
+{
+  CacheEntry &entry = machine->dictionary[block_id];
+  int set = block_id / CACHE_WAYS;
+  int i;
+  
+  entry.pc = pc;
+  entry.reused = false;
+  
+  if (replacement_policy == POLICY_SHIP)
+    entry.rrpv = predicted_dead(pc) ? SHIP_RRPV_MAX : SHIP_RRPV_MAX - 1;
+  else if (predicted_dead(pc))
+    entry.rrpv = HAWKEYE_RRPV_MAX;
+  else
+  {
+    // the other blocks we expect to be reused get older, but stay ahead of those we don't
+    for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS; i++)
+    {
+      if (i != block_id && machine->dictionary[i].rrpv < HAWKEYE_RRPV_MAX - 1)
+        machine->dictionary[i].rrpv++;
+    }
+    entry.rrpv = 0;
+  }
+}
+
+// updates the prediction for a block that's just been hit
+void rrip_hit(int block_id, unsigned short pc)
+{
+  CacheEntry &entry = machine->dictionary[block_id];
+  
+  if (replacement_policy == POLICY_SHIP)
+  {
+    train_signature(entry.pc, true);
+    entry.reused = true;
+    entry.rrpv = 0;
+  }
+  else
+  {
+    entry.pc = pc;
+    entry.rrpv = predicted_dead(pc) ? HAWKEYE_RRPV_MAX : 0;
+  }
+}
+
+// lists the MOVEs whose counters ended up predicting that their blocks won't be reused
+// every counter starts out predicting reuse, so these are all MOVEs that made accesses
+static void print_dead_signatures()
+{
+  int dead = 0;
+  int pc;
+  
+  for (pc = 0; pc < CODE_SIZE; pc++)
+  {
+    if (!predicted_dead(pc))
+      continue;
+  
+    if (dead == 0)
+      printf("MOVEs predicted not to reuse their blocks:");
+    if (dead < DUEL_HISTORY)
+      printf(" %04x", pc);
+    dead++;
+  }
+  
+  if (dead)
+    printf("%s\n", dead > DUEL_HISTORY ? " ..." : "");
+  else
+    printf("Every MOVE is predicted to reuse its blocks.\n");
+}
+
+// reports how the replacement policy adapted to the program
+void print_policy_statistics()
+{
+  unsigned long i;
+  long targets = 0;
+  int set;
+  
+  if (replacement_policy == POLICY_DIP)
+  {
+    printf("Set dueling: LRU insertion was winning at the end of %ld and BIP at the end of %ld windows of %d accesses.\n",
+           machine->duel_windows[0], machine->duel_windows[1], DUEL_WINDOW);
+    if (machine->lead_changes)
+    {
+      printf("The lead changed %ld times, at access", machine->lead_changes);
+      for (i = 0; i < machine->lead_changes && i < DUEL_HISTORY; i++)
+        printf(" %ld (to %s)", machine->lead_history[i], i % 2 == 0 ? "BIP" : "LRU");
+      printf("%s\n", machine->lead_changes > DUEL_HISTORY ? " ..." : "");
+    }
+    printf("\n");
+  }
+  else if (replacement_policy == POLICY_ARC)
+  {
+    for (set = 0; set < CACHE_SETS; set++)
+      targets += machine->arc_sets[set].target;
+    printf("ARC ended up aiming to keep an average of %.1f of %d ways for blocks seen once.\n\n",
+           (double)targets / CACHE_SETS, CACHE_WAYS);
+  }
+  else if (replacement_policy == POLICY_SHIP || replacement_policy == POLICY_HAWKEYE)
+  {
+    if (replacement_policy == POLICY_HAWKEYE)
+      printf("OPTgen found that OPT would have hit on %ld of %ld accesses (%4.3f).\n", machine->opt_hits,
+             machine->opt_accesses, machine->opt_accesses ? (double)machine->opt_hits / (double)machine->opt_accesses : 0.0);
+    printf("%ld misses were predicted not to be reused and %ld accesses bypassed the cache.\n",
+           machine->dead_predictions, machine->cache_bypasses);
+    print_dead_signatures();
+    printf("\n");
+  }
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// main memory routines
+//
+// With -g the cache's fills and writebacks go through a model of a DRAM memory controller. Each
+// request goes to the bank holding its row. If the bank has that row open it's a row buffer hit and
+// only needs a column access, if the bank is precharged the row has to be activated first, and if
+// another row is open (a bank conflict) that has to be precharged as well. Banks work in parallel but
+// share their channel's data bus. The open page policy leaves rows open after each access, while the
+// closed page policy precharges them straight away.
+//
+// The controller queues requests and schedules them FR-FCFS: of the requests that have arrived, row
+// buffer hits go first, then the oldest. Writebacks are queued until the controller has to make
+// room or a read waits behind them, so they can still delay the read the processor is stalled on.
+// A read stalls the processor until its data arrives, and those cycles are added to the cycle count.
+
+static const char *page_names[NUM_PAGE_POLICIES] =
+{
+  "none", "open", "closed"
+};
+
+// works out where a word lives in the DRAM
+static inline DramBank &dram_locate(unsigned short addr, int &channel, long &row)
+{
+  unsigned long rows = addr / DRAM_ROW_WORDS;
+  int bank, rank;
+  
+  channel = rows % DRAM_CHANNELS;
+  rows /= DRAM_CHANNELS;
+  bank = rows % DRAM_BANKS;
+  rows /= DRAM_BANKS;
+  rank = rows % DRAM_RANKS;
+  row = rows / DRAM_RANKS;
+  
+  return machine->dram.banks[channel][rank][bank];
+}
+
+// carries out a request, returning the cycle its data transfer finishes
+static unsigned long dram_service(const DramRequest &request)
+{
+  Dram &dram = machine->dram;
+  int channel;
+  long row;
+  DramBank &bank = dram_locate(request.addr, channel, row);
+  unsigned long start = std::max(std::max(request.arrival, dram.clock), bank.ready);
+  unsigned long latency = DRAM_TCAS;
+  unsigned long finish;
+  
+  if (bank.open_row == row)
+    dram.row_hits++;
+  else if (bank.open_row == -1)
+  {
+    dram.row_empty++;
+    latency += DRAM_TRCD;
+  }
+  else
+  {
+    dram.bank_conflicts++;
+    latency += DRAM_TRP + DRAM_TRCD;
+  }
+  
+  // the data goes over the channel's bus once it's free
+  finish = std::max(start + latency, dram.bus_free[channel]) + (request.words + DRAM_BUS_WORDS - 1) / DRAM_BUS_WORDS;
+  dram.bus_free[channel] = finish;
+  
+  if (page_policy == PAGE_OPEN)
+  {
+    bank.open_row = row;
+    bank.ready = start + latency;
+  }
+  else
+  {
+    bank.open_row = -1;
+    bank.ready = finish + DRAM_TRP;
+  }
+  
+  if (request.write)
+  {
+    dram.writes++;
+    dram.write_latency += finish - request.arrival;
+  }
+  else
+  {
+    dram.reads++;
+    dram.read_latency += finish - request.arrival;
+  }
+  
+  return finish;
+}
+
+// picks the next request FR-FCFS and carries it out, returning its id and when it finished
+static unsigned long dram_schedule(unsigned long &finish)
+{
+  Dram &dram = machine->dram;
+  unsigned long now = ULONG_MAX;
+  unsigned long id;
+  int best = -1;
+  int channel;
+  long row;
+  int i;
+  
+  // nothing can be scheduled before the controller's last decision or before anything has arrived
+  for (i = 0; i < dram.queued; i++)
+    now = std::min(now, dram.queue[i].arrival);
+  now = std::max(now, dram.clock);
+  
+  // the oldest row buffer hit, otherwise the oldest request -- the queue is in order of arrival
+  for (i = 0; i < dram.queued; i++)
+  {
+    if (dram.queue[i].arrival > now)
+      continue;
+    if (best == -1)
+      best = i;
+    if (dram_locate(dram.queue[i].addr, channel, row).open_row == row)
+    {
+      best = i;
+      break;
+    }
+  }
+  
+  dram.clock = now;
+  finish = dram_service(dram.queue[best]);
+  id = dram.queue[best].id;
+  
+  dram.queued--;
+  memmove(&dram.queue[best], &dram.queue[best + 1], (dram.queued - best) * sizeof(DramRequest));
+  
+  return id;
+}
+
+// adds a request to the controller's queue, making room first if it's full
+static unsigned long dram_request(unsigned short addr, int words, bool write)
+{
+  Dram &dram = machine->dram;
+  unsigned long finish;
+  
+  if (dram.queued == DRAM_QUEUE)
+    dram_schedule(finish);
+  
+  dram.queue[dram.queued].id = dram.next_id++;
+  dram.queue[dram.queued].arrival = machine->cycle_count;
+  dram.queue[dram.queued].addr = addr;
+  dram.queue[dram.queued].words = words;
+  dram.queue[dram.queued].write = write;
+  dram.queued++;
+  
+  return dram.next_id - 1;
+}
+
+// reads words from the DRAM, stalling until they arrive
+void dram_read(unsigned short addr, int words)
+{
+  unsigned long arrival = machine->cycle_count;
+  unsigned long id;
+  unsigned long finish = arrival;
+  
+  if (page_policy == PAGE_NONE)
+    return;
+  
+  id = dram_request(addr, words, false);
+  while (dram_schedule(finish) != id)
+    ;
+  
+  machine->dram.stall_cycles += finish - arrival;
+  machine->cycle_count += finish - arrival;
+}
+
+// queues words to be written to the DRAM -- we don't wait for writes
+void dram_write(unsigned short addr, int words)
+{
+  if (page_policy != PAGE_NONE)
+    dram_request(addr, words, true);
+}
+
+// Between the cache and memory (the DRAM when there is one) there's a bus that carries -w bytes
+// a cycle, one transfer at a time. A read waits for the bus to be free and then for its data to
+// cross it, stalling the processor. Writes are posted, so their requester carries on, but only
+// BUS_QUEUE transfers can be outstanding -- once the queue is full the next requester is held until
+// the oldest transfer finishes. The bus is shared by all the machines run_jobs() interleaves, so
+// they contend for its bandwidth, each arriving at the bus at its own cycle count.
+
+// puts a transfer on the bus, stalling the current machine as it has to
+static void bus_transfer(int words, bool write)
+{
+  unsigned long now = machine->cycle_count;
+  unsigned long &oldest = bus.finishes[bus.next];
+  unsigned long cycles = (words * WORD_SIZE + bus_width - 1) / bus_width;
+  unsigned long start, finish;
+  
+  if (oldest > now)
+  {
+    bus.back_pressure += oldest - now;
+    machine->bus_stall_cycles += oldest - now;
+    machine->cycle_count = now = oldest;
+  }
+  
+  start = std::max(now, bus.free);
+  finish = start + cycles;
+  bus.free = oldest = finish;
+  bus.next = (bus.next + 1) % BUS_QUEUE;
+  
+  bus.transfers[write]++;
+  bus.bytes[write] += words * WORD_SIZE;
+  bus.busy[write] += cycles;
+  bus.queue_delay[write] += start - now;
+  
+  if (!write)
+  {
+    machine->bus_stall_cycles += finish - now;
+    machine->cycle_count = finish;
+  }
+}
+
+// reads words from memory into the cache, stalling until they've arrived
+void memory_read(unsigned short addr, int words)
+{
+  if (!hierarchies.empty())
+    miss_stream.push_back(addr2tag(addr) << 1);
+  dram_read(addr, words);
+  if (bus_width)
+    bus_transfer(words, false);
+}
+
+// writes words from the cache back to memory
+void memory_write(unsigned short addr, int words)
+{
+  if (!hierarchies.empty())
+    miss_stream.push_back(addr2tag(addr) << 1 | 1);
+  if (bus_width)
+    bus_transfer(words, true);
+  dram_write(addr, words);
+}
+
+// writes an all zero block back as just a flag, which neither takes up the bus nor reaches the DRAM
+void memory_write_zero(unsigned short addr)
+{
+  if (!hierarchies.empty())
+    miss_stream.push_back(addr2tag(addr) << 1 | 1);
+  bus.zero_flags++;
+}
+
+// reports how busy the bus was over the given number of cycles
+void print_bus_statistics(unsigned long cycles)
+{
+  if (!bus_width)
+    return;
+  
+  cycles = std::max(cycles, 1UL);
+  printf("The bus (%d bytes a cycle) carried %ld bytes in %ld reads and %ld bytes in %ld writes, for %.2f bytes a cycle read "
+         "and %.2f written (%.1f%% busy) over %ld cycles.\n", bus_width, bus.bytes[0], bus.transfers[0], bus.bytes[1],
+         bus.transfers[1], (double)bus.bytes[0] / cycles, (double)bus.bytes[1] / cycles,
+         100.0 * std::min(1.0, (double)(bus.busy[0] + bus.busy[1]) / cycles), cycles);
+  printf("Reads waited an average of %.1f cycles for the bus and writes %.1f, and requesters were held for %ld cycles by a full queue.\n",
+         bus.transfers[0] ? (double)bus.queue_delay[0] / bus.transfers[0] : 0.0,
+         bus.transfers[1] ? (double)bus.queue_delay[1] / bus.transfers[1] : 0.0, bus.back_pressure);
+  if (track_zero_lines)
+    printf("%ld zero lines were written back as a flag instead of a transfer.\n", bus.zero_flags);
+  printf("\n");
+}
+
+// reports how the DRAM did, after carrying out any writes that are still queued
+void print_dram_statistics()
+{
+  Dram &dram = machine->dram;
+  unsigned long finish;
+  unsigned long accesses;
+  
+  if (page_policy == PAGE_NONE)
+    return;
+  
+  while (dram.queued)
+    dram_schedule(finish);
+  accesses = dram.reads + dram.writes;
+  
+  printf("DRAM (%s page) served %ld reads and %ld writes: %ld row buffer hits, %ld to precharged banks and %ld bank conflicts, "
+         "for a row buffer hit rate of %4.3f.\n", page_names[page_policy], dram.reads, dram.writes, dram.row_hits, dram.row_empty,
+         dram.bank_conflicts, accesses ? (double)dram.row_hits / accesses : 0.0);
+  printf("Reads took an average of %.1f cycles and writes %.1f, and the processor stalled for %ld cycles waiting on memory.\n\n",
+         dram.reads ? (double)dram.read_latency / dram.reads : 0.0, dram.writes ? (double)dram.write_latency / dram.writes : 0.0,
+         dram.stall_cycles);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// miss ratio curve routines
+//
+// -l estimates the miss ratio of a fully associative LRU cache of every size in the one run, using
+// SHARDS. Each block's tag is hashed, and only the blocks whose hash falls under a threshold -- a
+// fixed fraction R of all blocks -- are sampled. The sampled blocks are kept in their own LRU stack.
+// When one is accessed again, the number of sampled blocks used since is its stack distance among
+// the samples, and dividing by R estimates its stack distance among all the blocks: the access
+// hits in any cache at least that many blocks big. Since a block is either always or never sampled,
+// the sample keeps the reuse pattern of the blocks in it. The miss ratio for a size is then the
+// fraction of the sampled accesses with a longer distance.
+//
+// With a limit on the blocks tracked, whenever the stack would grow past it the sampled block with
+// the largest hash is dropped and the threshold lowered to that hash, scaling down the counts we've
+// already made to match the new rate.
+//
+// The error comes from the blocks sampled, not the accesses: a few hot blocks can make or break the
+// estimate. So each sampled block also falls into one of MRC_GROUPS groups by its hash, and the
+// error shown is two standard errors worked out from how far each group's misses are from what the
+// overall miss ratio gives for its accesses, shrunk as the rate approaches 1 (where it's exact).
+// With the small data area, low rates leave few blocks in the sample and the error says so.
+
+// the hash that decides which blocks are sampled
+static inline unsigned long mrc_hash(unsigned long tag)
+{
+  unsigned long hash = (tag + 0x9E3779B97F4A7C15UL) * 0xBF58476D1CE4E5B9UL;
+  
+  hash ^= hash >> 27;
+  hash *= 0x94D049BB133111EBUL;
+  hash ^= hash >> 31;
+  return hash % MRC_MODULUS;
+}
+
+// drops the sampled block with the largest hash and lowers the sampling rate to leave it out
+static void mrc_lower_rate()
+{
+  unsigned long largest = 0;
+  int i, kept;
+  
+  for (i = 0; i < mrc.tracked; i++)
+    largest = std::max(largest, mrc_hash(mrc.stack[i]));
+  
+  for (i = kept = 0; i < mrc.tracked; i++)
+  {
+    if (mrc_hash(mrc.stack[i]) < largest)
+      mrc.stack[kept++] = mrc.stack[i];
+  }
+  mrc.tracked = kept;
+  
+  for (i = 0; i < MRC_GROUPS * (DATA_SIZE + 1); i++)
+    (&mrc.histogram[0][0])[i] *= (double)largest / mrc.threshold;
+  mrc.threshold = largest;
+}
+
+// records an access to a block, if it's one we're sampling
+static void mrc_access(unsigned long tag)
+{
+  double rate = (double)mrc.threshold / MRC_MODULUS;
+  unsigned long hash = mrc_hash(tag);
+  double *histogram = mrc.histogram[hash % MRC_GROUPS];
+  int distance;
+  
+  mrc.accesses++;
+  if (hash >= mrc.threshold)
+    return;
+  mrc.samples++;
+  
+  for (distance = 0; distance < mrc.tracked && mrc.stack[distance] != tag; distance++)
+    ;
+  
+  if (distance < mrc.tracked)
+    histogram[std::min((int)(distance / rate), DATA_SIZE - 1)]++;
+  else
+  {
+    histogram[DATA_SIZE]++;
+    mrc.tracked++;
+  }
+  
+  // move it to the top of the stack
+  memmove(&mrc.stack[1], &mrc.stack[0], distance * sizeof(mrc.stack[0]));
+  mrc.stack[0] = tag;
+  
+  if (mrc_limit && mrc.tracked > mrc_limit)
+    mrc_lower_rate();
+}
+
+// shows the estimated miss ratio of fully associative LRU caches from one block up to all of memory
+void print_miss_ratio_curve()
+{
+  double accesses[MRC_GROUPS] = { 0 };
+  double hits[MRC_GROUPS] = { 0 };
+  double rate = (double)mrc.threshold / MRC_MODULUS;
+  double total_accesses = 0, total_hits, ratio, spread;
+  int distance, size, group, groups = 0;
+  
+  if (mrc_rate == 0)
+    return;
+  
+  for (group = 0; group < MRC_GROUPS; group++)
+  {
+    for (distance = 0; distance <= DATA_SIZE; distance++)
+      accesses[group] += mrc.histogram[group][distance];
+    total_accesses += accesses[group];
+    groups += accesses[group] > 0;
+  }
+  
+  printf("Miss ratio curve from %ld of %ld accesses (SHARDS sampling %.4f of the blocks, tracking %d of them):\n",
+         mrc.samples, mrc.accesses, rate, mrc.tracked);
+  
+  for (size = 1, distance = 0; size <= DATA_SIZE && total_accesses > 0; size *= 2)
+  {
+    for (; distance < size; distance++)
+    {
+      for (group = 0; group < MRC_GROUPS; group++)
+        hits[group] += mrc.histogram[group][distance];
+    }
+    
+    total_hits = spread = 0;
+    for (group = 0; group < MRC_GROUPS; group++)
+      total_hits += hits[group];
+    ratio = 1 - total_hits / total_accesses;
+    for (group = 0; group < MRC_GROUPS; group++)
+    {
+      if (accesses[group] > 0)
+        spread += (accesses[group] - hits[group] - ratio * accesses[group]) * (accesses[group] - hits[group] - ratio * accesses[group]);
+    }
+    
+    if (groups > 1)
+      printf("  %4d blocks (%5d words): miss ratio %5.3f +/- %5.3f\n", size, size * BLOCK_SIZE, ratio,
+             2 * sqrt(spread * groups / (groups - 1) * (1 - rate)) / total_accesses);
+    else
+      printf("  %4d blocks (%5d words): miss ratio %5.3f\n", size, size * BLOCK_SIZE, ratio);
+  }
+  printf("\n");
+}
+
+// works out the SHARDS sampling rate and the optional limit on the blocks it tracks, returning
+// false if we can't make sense of them
+bool parse_mrc(const char *option)
+{
+  double rate;
+  int limit = 0;
+  
+  if (sscanf(option, "%lf:%d", &rate, &limit) < 1 || rate <= 0 || rate > 1 || limit < 0 || limit > DATA_SIZE)
+    return false;
+  
+  mrc_rate = rate;
+  mrc_limit = limit;
+  return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// all associativity routines
+//
+// -o counts the misses of LRU caches of every power of two number of sets and every associativity,
+// with this build's block size and mod indexing, in the one run (Hill and Smith's all associativity
+// simulation). All the blocks are kept in one LRU stack. With 2^k sets, two blocks share a set when
+// their tags agree in the low k bits, and a set's own LRU stack is just the global stack with the
+// other sets' blocks left out. So when a block is accessed, each block above it in the global stack
+// is counted towards its stack distance for every k up to the number of low bits they have in
+// common. The access hits in a cache of 2^k sets with more ways than that distance. Checking that
+// against the geometry we're built with is easy: the sweep's count for it matches the run's misses.
+
+// records an access to a block in every geometry at once
+static void sweep_access(unsigned long tag)
+{
+  int levels = log2_floor(DATA_SIZE) + 1;
+  int distances[SWEEP_LEVELS] = { 0 };
+  int depth, level, common;
+  
+  sweep_state.accesses++;
+  
+  for (depth = 0; depth < sweep_state.tracked && sweep_state.stack[depth] != tag; depth++)
+  {
+    common = std::min(__builtin_ctzl(sweep_state.stack[depth] ^ tag), levels - 1);
+    for (level = 0; level <= common; level++)
+      distances[level]++;
+  }
+  
+  for (level = 0; level < levels; level++)
+    sweep_state.histogram[level][depth < sweep_state.tracked ? distances[level] : DATA_SIZE]++;
+  
+  if (depth == sweep_state.tracked)
+    sweep_state.tracked++;
+  memmove(&sweep_state.stack[1], &sweep_state.stack[0], depth * sizeof(sweep_state.stack[0]));
+  sweep_state.stack[0] = tag;
+}
+
+// shows the misses of every geometry that fits in memory, a row for each number of sets
+void print_sweep()
+{
+  int levels = log2_floor(DATA_SIZE) + 1;
+  unsigned long hits;
+  int level, ways, distance;
+  
+  if (!sweep)
+    return;
+  
+  printf("Misses in %ld accesses for every LRU cache of %d word blocks (sets down, ways across):\n      ",
+         sweep_state.accesses, BLOCK_SIZE);
+  for (ways = 1; ways <= DATA_SIZE; ways *= 2)
+    printf(" %7d", ways);
+  printf("\n");
+  
+  for (level = 0; level < levels; level++)
+  {
+    printf("  %4d", 1 << level);
+    hits = 0;
+    for (ways = 1, distance = 0; ways <= DATA_SIZE >> level; ways *= 2)
+    {
+      for (; distance < ways; distance++)
+        hits += sweep_state.histogram[level][distance];
+      printf(" %7ld", sweep_state.accesses - hits);
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// filtered sweep routines
+//
+// -h sweeps the levels below our cache. Our cache is simulated once, and every block it reads
+// from memory or writes back is kept in miss_stream, two bytes apiece. At the end that stream is
+// replayed through each hierarchy of lower levels, the hierarchies shared out between threads. The
+// lower levels are write back, write allocate, LRU, mod indexed, use our block size and are
+// non-inclusive -- they never reach back up and evict anything from the levels above -- so what
+// our cache does can't depend on them, and replaying its stream gives exactly what simulating the
+// whole hierarchy would. A read that misses is fetched from the level below. A writeback that
+// misses is a whole block, so it's allocated without being fetched (with sectors only the dirty
+// words are really written back, so there this is an approximation). Dirty victims are written
+// back to the level below, and whatever misses or is written back from the last level goes to memory.
+
+// carries out a read or a writeback at a level of a hierarchy, and whatever it leads to below
+static void lower_access(Hierarchy &hierarchy, vector<LowerCache> &caches, int level, int tag, bool write)
+{
+  LowerCache &cache = caches[level];
+  int ways = hierarchy.levels[level].ways;
+  int base, way, victim;
+  
+  if (level == hierarchy.depth)
+    return;
+  base = victim = tag % hierarchy.levels[level].sets * ways;
+  
+  if (write)
+    hierarchy.writes[level]++;
+  else
+    hierarchy.reads[level]++;
+  
+  for (way = base; way < base + ways; way++)
+  {
+    if (cache.tags[way] == tag)
+    {
+      cache.stamps[way] = ++cache.clock;
+      if (write)
+        cache.dirty[way] = true;
+      return;
+    }
+    if (cache.stamps[way] < cache.stamps[victim])
+      victim = way;
+  }
+  
+  if (write)
+    hierarchy.write_misses[level]++;
+  else
+    hierarchy.read_misses[level]++;
+  
+  if (cache.tags[victim] != -1 && cache.dirty[victim])
+  {
+    hierarchy.writebacks[level]++;
+    lower_access(hierarchy, caches, level + 1, cache.tags[victim], true);
+  }
+  if (!write)
+    lower_access(hierarchy, caches, level + 1, tag, false);
+  
+  cache.tags[victim] = tag;
+  cache.stamps[victim] = ++cache.clock;
+  cache.dirty[victim] = write;
+}
+
+// replays our cache's fills and writebacks through one hierarchy
+static void replay_hierarchy(Hierarchy &hierarchy)
+{
+  vector<LowerCache> caches(hierarchy.depth + 1);
+  size_t i;
+  int level;
+  
+  for (level = 0; level < hierarchy.depth; level++)
+  {
+    caches[level].tags.assign(hierarchy.levels[level].sets * hierarchy.levels[level].ways, -1);
+    caches[level].stamps.assign(caches[level].tags.size(), 0);
+    caches[level].dirty.assign(caches[level].tags.size(), false);
+    caches[level].clock = 0;
+  }
+  
+  for (i = 0; i < miss_stream.size(); i++)
+    lower_access(hierarchy, caches, 0, miss_stream[i] >> 1, miss_stream[i] & 1);
+}
+
+// replays the stream through every hierarchy in parallel and shows how each level did
+void print_hierarchies()
+{
+  vector<std::thread> workers;
+  std::atomic<size_t> next_hierarchy(0);
+  int threads = std::min((size_t)std::max(std::thread::hardware_concurrency(), 1U), hierarchies.size());
+  unsigned long writebacks;
+  size_t h;
+  int i, level;
+  
+  if (hierarchies.empty())
+    return;
+  
+  for (i = 0; i < threads; i++)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      size_t next;
+      
+      while ((next = next_hierarchy.fetch_add(1)) < hierarchies.size())
+        replay_hierarchy(hierarchies[next]);
+    }));
+  }
+  for (i = 0; i < threads; i++)
+    workers[i].join();
+  
+  writebacks = std::count_if(miss_stream.begin(), miss_stream.end(), [](unsigned short entry) { return entry & 1; });
+  printf("Replayed the cache's %zu fills and %ld writebacks through %zu hierarchies on %d threads:\n",
+         miss_stream.size() - writebacks, writebacks, hierarchies.size(), threads);
+  
+  for (h = 0; h < hierarchies.size(); h++)
+  {
+    Hierarchy &hierarchy = hierarchies[h];
+    
+    printf("  %s:", hierarchy.name.c_str());
+    for (level = 0; level < hierarchy.depth; level++)
+    {
+      printf(" L%d %ld reads (%4.3f missed), %ld writes (%4.3f missed), %ld writebacks;", level + 2,
+             hierarchy.reads[level], hierarchy.reads[level] ? (double)hierarchy.read_misses[level] / hierarchy.reads[level] : 0.0,
+             hierarchy.writes[level], hierarchy.writes[level] ? (double)hierarchy.write_misses[level] / hierarchy.writes[level] : 0.0,
+             hierarchy.writebacks[level]);
+    }
+    printf(" memory %ld reads, %ld writes\n", hierarchy.read_misses[hierarchy.depth - 1], hierarchy.writebacks[hierarchy.depth - 1]);
+  }
+  printf("\n");
+}
+
+// reads the hierarchies to sweep -- a comma separated list, each one or more levels of sets x ways joined by +
+bool parse_hierarchies(const char *option)
+{
+  const char *start = option;
+  Hierarchy hierarchy = Hierarchy();
+  int sets, ways, used;
+  
+  for (;;)
+  {
+    if (hierarchy.depth == LOWER_LEVELS || sscanf(option, "%dx%d%n", &sets, &ways, &used) != 2 || sets <= 0 || ways <= 0)
+      return false;
+    hierarchy.levels[hierarchy.depth].sets = sets;
+    hierarchy.levels[hierarchy.depth].ways = ways;
+    hierarchy.depth++;
+    option += used;
+    
+    if (*option == '+')
+    {
+      option++;
+      continue;
+    }
+    
+    hierarchy.name = string(start, option - start);
+    hierarchies.push_back(hierarchy);
+    if (*option == '\0')
+      return true;
+    if (*option != ',')
+      return false;
+    
+    start = ++option;
+    hierarchy = Hierarchy();
+  }
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// lockstep direct mapped routines
+//
+// -D simulates up to LOCKSTEP_LANES direct mapped caches, each with its own number of lines and
+// block size, on the same accesses as ours. A direct mapped cache only has to compare one tag and
+// replace it on a miss, so the caches are kept side by side as the lanes of a vector: every access
+// shifts and masks its address by each lane's own amounts, gathers the tags of the lines that picks
+// out, compares them all at once, counts the misses and writes the new tags back. With AVX-512 the
+// write back is a masked scatter, 16 lanes at a time. AVX2 has no scatter, so it does 8 lanes at a
+// time and writes back the lanes that missed one by one. Without either, the same work is done a
+// lane at a time. They all count the same misses, which match a build with that many blocks and
+// CACHE_WAYS=1.
+
+static const char *lockstep_engine =
+#if defined(__AVX512F__)
+  "AVX-512";
+#elif defined(__AVX2__)
+  "AVX2";
+#else
+  "scalar";
+#endif
+
+// runs an access through every lane
+static void lockstep_access(unsigned short addr)
+{
+  int32_t *tags = lockstep.tags.data();
+  int lane;
+  
+#if defined(__AVX512F__)
+  __m512i address = _mm512_set1_epi32(addr);
+  
+  for (lane = 0; lane < lockstep.lanes; lane += 16)
+  {
+    // (the masked forms keep some versions of GCC from warning about the unmasked ones' undefined inputs)
+    __m512i block = _mm512_maskz_srlv_epi32(0xFFFF, address, _mm512_load_si512(&lockstep.shifts[lane]));
+    __m512i line = _mm512_add_epi32(_mm512_and_si512(block, _mm512_load_si512(&lockstep.masks[lane])),
+                                    _mm512_load_si512(&lockstep.bases[lane]));
+    __m512i tag = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, line, tags, 4);
+    __mmask16 missed = _mm512_cmpneq_epi32_mask(tag, block);
+    __m512i misses = _mm512_load_si512(&lockstep.misses[lane]);
+    
+    _mm512_store_si512(&lockstep.misses[lane], _mm512_mask_add_epi32(misses, missed, misses, _mm512_set1_epi32(1)));
+    _mm512_mask_i32scatter_epi32(tags, missed, line, block, 4);
+  }
+#elif defined(__AVX2__)
+  __m256i address = _mm256_set1_epi32(addr);
+  alignas(32) int32_t blocks[8], lines[8];
+  int missed, i;
+  
+  for (lane = 0; lane < lockstep.lanes; lane += 8)
+  {
+    __m256i block = _mm256_srlv_epi32(address, _mm256_load_si256((const __m256i *)&lockstep.shifts[lane]));
+    __m256i line = _mm256_add_epi32(_mm256_and_si256(block, _mm256_load_si256((const __m256i *)&lockstep.masks[lane])),
+                                    _mm256_load_si256((const __m256i *)&lockstep.bases[lane]));
+    __m256i hit = _mm256_cmpeq_epi32(_mm256_i32gather_epi32(tags, line, 4), block);
+    __m256i misses = _mm256_load_si256((const __m256i *)&lockstep.misses[lane]);
+    
+    // a hit is -1 in its lane, so adding one and then the hit counts the misses
+    misses = _mm256_add_epi32(misses, _mm256_add_epi32(hit, _mm256_set1_epi32(1)));
+    _mm256_store_si256((__m256i *)&lockstep.misses[lane], misses);
+    
+    missed = ~_mm256_movemask_ps(_mm256_castsi256_ps(hit)) & 0xFF;
+    if (missed)
+    {
+      _mm256_store_si256((__m256i *)blocks, block);
+      _mm256_store_si256((__m256i *)lines, line);
+      for (; missed; missed &= missed - 1)
+      {
+        i = __builtin_ctz(missed);
+        tags[lines[i]] = blocks[i];
+      }
+    }
+  }
+#else
+  int32_t block, line;
+  
+  for (lane = 0; lane < lockstep.lanes; lane++)
+  {
+    block = addr >> lockstep.shifts[lane];
+    line = (block & lockstep.masks[lane]) + lockstep.bases[lane];
+    if (tags[line] != block)
+    {
+      lockstep.misses[lane]++;
+      tags[line] = block;
+    }
+  }
+#endif
+  
+  // keep the 32 bit counts from overflowing
+  if (++lockstep.accesses % LOCKSTEP_FLUSH == 0)
+  {
+    for (lane = 0; lane < lockstep.lanes; lane++)
+    {
+      lockstep.total_misses[lane] += lockstep.misses[lane];
+      lockstep.misses[lane] = 0;
+    }
+  }
+}
+
+// shows the misses of each lane
+void print_lockstep()
+{
+  unsigned long misses;
+  int lane;
+  
+  if (!lockstep.configs)
+    return;
+  
+  printf("Misses in %ld accesses for each direct mapped cache (lines x words, %s):\n", lockstep.accesses, lockstep_engine);
+  for (lane = 0; lane < lockstep.configs; lane++)
+  {
+    misses = lockstep.total_misses[lane] + lockstep.misses[lane];
+    printf("  %9s: %ld misses, a miss rate of %4.3f\n", lockstep.names[lane].c_str(), misses,
+           lockstep.accesses ? (double)misses / lockstep.accesses : 0.0);
+  }
+  printf("\n");
+}
+
+// reads the direct mapped caches to simulate in lockstep -- a comma separated list of lines x words,
+// both powers of two -- and lays out their lanes, padding them with one line lanes that we ignore
+bool parse_lockstep(const char *option)
+{
+  int lines, words, used, shift;
+  const char *start;
+  
+  for (;;)
+  {
+    start = option;
+    if (lockstep.configs == LOCKSTEP_LANES || sscanf(option, "%dx%d%n", &lines, &words, &used) != 2 ||
+        lines <= 0 || (lines & (lines - 1)) || words <= 0 || (words & (words - 1)) || words > DATA_WORDS)
+      return false;
+    
+    for (shift = 0; (1 << shift) < words; shift++)
+      ;
+    lockstep.shifts[lockstep.configs] = shift;
+    lockstep.masks[lockstep.configs] = lines - 1;
+    lockstep.bases[lockstep.configs] = lockstep.tags.size();
+    lockstep.names[lockstep.configs] = string(start, used);
+    lockstep.tags.resize(lockstep.tags.size() + lines, -1);
+    lockstep.configs++;
+    
+    option += used;
+    if (*option == '\0')
+      break;
+    if (*option++ != ',')
+      return false;
+  }
+  
+  for (lockstep.lanes = lockstep.configs; lockstep.lanes % LOCKSTEP_WIDTH; lockstep.lanes++)
+  {
+    lockstep.masks[lockstep.lanes] = 0;
+    lockstep.bases[lockstep.lanes] = lockstep.tags.size();
+    lockstep.tags.push_back(-1);
+  }
+  
+  return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// tag index routines
+//
+// A fully associative cache has to compare every block's tag on every access. Once it's big
+// enough (TAG_INDEX_BLOCKS), we keep an open addressing hash table from tags to blocks, laid out
+// like a Swiss table: each slot has a control byte, and the slots are probed a group of TAG_GROUP
+// at a time. A tag's hash picks the group to start at and gives seven bits to keep in the control
+// byte, so one SSE2 compare finds the slots in a group that could hold the tag, and only their
+// blocks' tags need checking. A group with an empty slot ends the search. Blocks are added as
+// they're filled and removed as they're written back, leaving a deleted marker so later probes
+// carry on past them. When the markers and tags fill 7/8 of the slots the table is rebuilt from the
+// dictionary. Skewed placement moves blocks around behind our back, so it keeps to the search.
+
+// whether this cache finds its blocks through the tag index
+static inline bool tag_indexed()
+{
+  return TAG_INDEX && index_function != INDEX_SKEW;
+}
+
+// the hash of a tag -- the top bits pick the group and the bottom seven go in the control byte
+static inline unsigned long tag_hash(unsigned long tag)
+{
+  unsigned long hash = tag * 0x9E3779B97F4A7C15UL;
+  
+  return hash ^ (hash >> 29);
+}
+
+// the slots in a group whose control byte is the given value, a bit apiece
+static inline unsigned group_match(const signed char *group, signed char value)
+{
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)group), _mm_set1_epi8(value)));
+#else
+  unsigned match = 0;
+  int i;
+  
+  for (i = 0; i < TAG_GROUP; i++)
+    match |= (unsigned)(group[i] == value) << i;
+  return match;
+#endif
+}
+
+// the slots in a group that are empty or deleted -- the only control bytes with the top bit set
+static inline unsigned group_free(const signed char *group)
+{
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+  unsigned match = 0;
+  int i;
+  
+  for (i = 0; i < TAG_GROUP; i++)
+    match |= (unsigned)(group[i] < 0) << i;
+  return match;
+#endif
+}
+
+// finds the slot holding a tag, or returns -1
+static int tag_index_find(unsigned long tag)
+{
+  unsigned long hash = tag_hash(tag);
+  int groups = TAG_INDEX_SLOTS / TAG_GROUP;
+  int group = (hash >> 7) & (groups - 1);
+  signed char *control;
+  unsigned match;
+  int probes, slot;
+  
+  for (probes = 0; probes < groups; probes++, group = (group + 1) & (groups - 1))
+  {
+    control = &machine->tag_control[group * TAG_GROUP];
+    for (match = group_match(control, hash & 0x7F); match; match &= match - 1)
+    {
+      slot = group * TAG_GROUP + __builtin_ctz(match);
+      if (machine->dictionary[machine->tag_blocks[slot]].tag == tag)
+        return slot;
+    }
+    if (group_match(control, TAG_EMPTY))
+      break;
+  }
+  
+  return -1;
+}
+
+// puts a block's tag in the index -- it mustn't be there already
+static void tag_index_add(unsigned long tag, int block_id)
+{
+  unsigned long hash = tag_hash(tag);
+  int groups = TAG_INDEX_SLOTS / TAG_GROUP;
+  int group = (hash >> 7) & (groups - 1);
+  unsigned free;
+  int slot;
+  
+  while (!(free = group_free(&machine->tag_control[group * TAG_GROUP])))
+    group = (group + 1) & (groups - 1);
+  
+  slot = group * TAG_GROUP + __builtin_ctz(free);
+  if (machine->tag_control[slot] == TAG_EMPTY)
+    machine->tag_slots_used++;
+  machine->tag_control[slot] = hash & 0x7F;
+  machine->tag_blocks[slot] = block_id;
+}
+
+// empties the index and puts every valid block back in it
+static void tag_index_rebuild()
+{
+  int i;
+  
+  memset(machine->tag_control, TAG_EMPTY, sizeof(machine->tag_control));
+  machine->tag_slots_used = 0;
+  
+  for (i = 0; i < CACHE_BLOCKS; i++)
+  {
+    if (machine->dictionary[i].valid)
+      tag_index_add(machine->dictionary[i].tag, i);
+  }
+}
+
+// takes a block being written back out of the index
+static void tag_index_remove(unsigned long tag)
+{
+  int slot = tag_index_find(tag);
+  
+  if (slot != -1)
+    machine->tag_control[slot] = TAG_DELETED;
+}
+
+// adds a block that's just been filled, rebuilding the index if the deleted slots are crowding it
+static void tag_index_fill(unsigned long tag, int block_id)
+{
+  if (machine->tag_slots_used >= TAG_INDEX_SLOTS / 8 * 7)
+    tag_index_rebuild();
+  tag_index_add(tag, block_id);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// shared cache QoS routines
+//
+// With -m each program runs on its own machine and its own cache. -Q also models them sharing
+// one cache of this build's geometry and set indexing, fed with every machine's accesses in the order they're made
+// (the machines' own caches still supply the data, so the programs run exactly as before). The
+// shared cache is modelled three ways at once:
+//
+// - shared: plain LRU over everyone's blocks, so programs evict each other freely
+// - cat: each program has a mask of the ways it can fill, as with Intel's Cache Allocation
+//   Technology -- it can hit in any way, but its misses only replace blocks in its own ways
+// - ucp: utility based cache partitioning. Each program has a utility monitor: shadow tags for
+//   the whole cache as if it had it to itself, counting the hits at each LRU stack position, which
+//   says how many hits each extra way is worth to it. Every UCP_INTERVAL accesses the lookahead
+//   algorithm hands out the ways, starting each program with one and repeatedly giving the next
+//   ways to whichever program gains most per way, then the counts are halved to age them. A miss
+//   takes a block from a program that's over its allocation in that set, or from its own blocks
+//   once it has its share.
+//
+// Each program's hit rate is reported under each scheme. To turn hits into speed, each miss costs
+// MISS_PENALTY cycles on top of the cycles the program ran for, and a scheme's weighted speedup is
+// the sum over the programs of the IPC they get under it divided by the IPC they'd get alone with
+// the whole cache, which the utility monitors' total hits tell us.
+
+static const char *qos_names[NUM_QOS_SCHEMES] =
+{
+  "shared", "cat", "ucp"
+};
+
+// sets up the model for the given number of programs
+static void qos_start(int programs)
+{
+  int scheme, program;
+  
+  qos.programs = programs;
+  for (scheme = 0; scheme < NUM_QOS_SCHEMES; scheme++)
+  {
+    qos.schemes[scheme].blocks.assign(CACHE_BLOCKS, SharedBlock());
+    qos.schemes[scheme].accesses.assign(programs, 0);
+    qos.schemes[scheme].hits.assign(programs, 0);
+  }
+  qos.shadows.assign((size_t)programs * CACHE_BLOCKS, SharedBlock());
+  qos.position_hits.assign((size_t)programs * CACHE_WAYS, 0);
+  qos.alone_hits.assign(programs, 0);
+  qos.owned.assign(programs, 0);
+  qos.clock = qos.repartitions = 0;
+  
+  // the masks we weren't given split the ways evenly, and UCP starts out the same way
+  qos.masks = cat_masks;
+  qos.allocation.assign(programs, 0);
+  for (program = 0; program < programs; program++)
+  {
+    int first = program * CACHE_WAYS / programs % CACHE_WAYS;
+    int ways = std::max(1, (program + 1) * CACHE_WAYS / programs - program * CACHE_WAYS / programs);
+    
+    if (program >= (int)qos.masks.size())
+      qos.masks.push_back(((ways >= (int)BITMAP_BITS ? ~0UL : (1UL << ways) - 1) << first));
+    qos.allocation[program] = ways;
+  }
+}
+
+// the LRU block of a set among those the filter accepts, preferring an empty one, or -1 if there's none
+template <typename Filter> static int shared_victim(vector<SharedBlock> &blocks, int base, Filter accept)
+{
+  int victim = -1;
+  int way;
+  
+  for (way = 0; way < CACHE_WAYS; way++)
+  {
+    if (!accept(way, blocks[base + way]))
+      continue;
+    if (!blocks[base + way].valid)
+      return base + way;
+    if (victim == -1 || blocks[base + way].stamp < blocks[victim].stamp)
+      victim = base + way;
+  }
+  
+  return victim;
+}
+
+// runs an access through a program's shadow tags, counting a hit at its LRU stack position
+static void umon_access(int program, int set, unsigned long tag)
+{
+  int base = (program * CACHE_SETS + set) * CACHE_WAYS;
+  int way, found = -1, position = 0;
+  
+  for (way = base; way < base + CACHE_WAYS; way++)
+  {
+    if (qos.shadows[way].valid && qos.shadows[way].tag == tag)
+      found = way;
+  }
+  
+  if (found != -1)
+  {
+    for (way = base; way < base + CACHE_WAYS; way++)
+      position += qos.shadows[way].valid && qos.shadows[way].stamp > qos.shadows[found].stamp;
+    qos.position_hits[program * CACHE_WAYS + position]++;
+    qos.alone_hits[program]++;
+  }
+  else
+  {
+    found = shared_victim(qos.shadows, base, [](int, const SharedBlock &) { return true; });
+    qos.shadows[found].valid = true;
+    qos.shadows[found].tag = tag;
+  }
+  qos.shadows[found].stamp = qos.clock;
+}
+
+// runs an access through the shared cache under one scheme
+static void qos_cache_access(int scheme, int program, int set, unsigned long tag)
+{
+  QosCache &cache = qos.schemes[scheme];
+  int base = set * CACHE_WAYS;
+  int way, victim = -1;
+  
+  cache.accesses[program]++;
+  for (way = base; way < base + CACHE_WAYS; way++)
+  {
+    if (cache.blocks[way].valid && cache.blocks[way].program == program && cache.blocks[way].tag == tag)
+    {
+      cache.hits[program]++;
+      cache.blocks[way].stamp = qos.clock;
+      return;
+    }
+  }
+  
+  switch (scheme)
+  {
+    case QOS_SHARED:
+      victim = shared_victim(cache.blocks, base, [](int, const SharedBlock &) { return true; });
+      break;
+    
+    case QOS_CAT:
+      victim = shared_victim(cache.blocks, base, [&](int way, const SharedBlock &)
+                             { return way >= (int)BITMAP_BITS || ((qos.masks[program] >> way) & 1); });
+      break;
+    
+    case QOS_UCP:
+      // count what each program holds in the set
+      std::fill(qos.owned.begin(), qos.owned.end(), 0);
+      for (way = base; way < base + CACHE_WAYS; way++)
+      {
+        if (cache.blocks[way].valid)
+          qos.owned[cache.blocks[way].program]++;
+      }
+      
+      if (qos.owned[program] < qos.allocation[program])
+        victim = shared_victim(cache.blocks, base, [&](int, const SharedBlock &block)
+                               { return !block.valid || qos.owned[block.program] > qos.allocation[block.program]; });
+      if (victim == -1)
+        victim = shared_victim(cache.blocks, base, [&](int, const SharedBlock &block)
+                               { return !block.valid || block.program == program; });
+      if (victim == -1)
+        victim = shared_victim(cache.blocks, base, [](int, const SharedBlock &) { return true; });
+      break;
+  }
+  
+  cache.blocks[victim].valid = true;
+  cache.blocks[victim].program = program;
+  cache.blocks[victim].tag = tag;
+  cache.blocks[victim].stamp = qos.clock;
+}
+
+// the hits a program's utility monitor says it would get from the given number of ways
+static unsigned long utility(int program, int ways)
+{
+  unsigned long hits = 0;
+  int position;
+  
+  for (position = 0; position < ways; position++)
+    hits += qos.position_hits[program * CACHE_WAYS + position];
+  
+  return hits;
+}
+
+// hands out the ways by the lookahead algorithm and ages the utility monitors
+static void ucp_repartition()
+{
+  int remaining = CACHE_WAYS - qos.programs;
+  int program, ways, best_program, best_ways;
+  double gain, best_gain;
+  size_t i;
+  
+  // with more programs than ways, everyone just keeps their one way
+  if (remaining >= 0)
+  {
+    qos.allocation.assign(qos.programs, 1);
+    while (remaining > 0)
+    {
+      best_program = 0;
+      best_ways = remaining;
+      best_gain = -1;
+      for (program = 0; program < qos.programs; program++)
+      {
+        for (ways = 1; ways <= remaining; ways++)
+        {
+          gain = (double)(utility(program, qos.allocation[program] + ways) - utility(program, qos.allocation[program])) / ways;
+          if (gain > best_gain)
+          {
+            best_gain = gain;
+            best_program = program;
+            best_ways = ways;
+          }
+        }
+      }
+      qos.allocation[best_program] += best_ways;
+      remaining -= best_ways;
+    }
+  }
+  
+  for (i = 0; i < qos.position_hits.size(); i++)
+    qos.position_hits[i] /= 2;
+  qos.repartitions++;
+}
+
+// runs the current machine's access through the shared cache model
+static void qos_access(unsigned long tag)
+{
+  int program = machine->qos_program;
+  int set = index_set(tag);
+  int scheme;
+  
+  qos.clock++;
+  umon_access(program, set, tag);
+  for (scheme = 0; scheme < NUM_QOS_SCHEMES; scheme++)
+    qos_cache_access(scheme, program, set, tag);
+  
+  if (qos.clock % UCP_INTERVAL == 0)
+    ucp_repartition();
+}
+
+// the instructions a program would run per cycle if its misses cost MISS_PENALTY cycles each
+static inline double qos_ipc(unsigned long instructions, unsigned long cycles, unsigned long misses)
+{
+  return cycles + misses * MISS_PENALTY ? (double)instructions / (cycles + misses * MISS_PENALTY) : 0.0;
+}
+
+// shows each program's hit rate under each scheme and the schemes' weighted speedups
+void print_qos(const vector<unsigned long> &instructions, const vector<unsigned long> &cycles)
+{
+  unsigned long accesses, misses;
+  double speedup, alone;
+  int scheme, program;
+  
+  printf("Sharing a %d set, %d way cache (%d cycles a miss, UCP repartitioned %ld times):\n", CACHE_SETS, CACHE_WAYS,
+         MISS_PENALTY, qos.repartitions);
+  
+  printf("  %-7s", "alone");
+  for (program = 0; program < qos.programs; program++)
+  {
+    accesses = qos.schemes[QOS_SHARED].accesses[program];
+    printf(" job %d %4.3f", program, accesses ? (double)qos.alone_hits[program] / accesses : 0.0);
+  }
+  printf("\n");
+  
+  for (scheme = 0; scheme < NUM_QOS_SCHEMES; scheme++)
+  {
+    QosCache &cache = qos.schemes[scheme];
+    
+    speedup = 0;
+    printf("  %-7s", qos_names[scheme]);
+    for (program = 0; program < qos.programs; program++)
+    {
+      accesses = cache.accesses[program];
+      misses = accesses - cache.hits[program];
+      printf(" job %d %4.3f", program, accesses ? (double)cache.hits[program] / accesses : 0.0);
+      
+      alone = qos_ipc(instructions[program], cycles[program], accesses - qos.alone_hits[program]);
+      if (alone > 0)
+        speedup += qos_ipc(instructions[program], cycles[program], misses) / alone;
+    }
+    printf(", weighted speedup %.3f", speedup);
+    
+    if (scheme == QOS_CAT)
+    {
+      printf(" (masks");
+      for (program = 0; program < qos.programs; program++)
+        printf(" %#lx", qos.masks[program]);
+      printf(")");
+    }
+    else if (scheme == QOS_UCP)
+    {
+      printf(" (last allocation");
+      for (program = 0; program < qos.programs; program++)
+        printf(" %d", qos.allocation[program]);
+      printf(")");
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+// reads the CAT masks -- "even" to split the ways evenly, or a comma separated list of masks, one
+// for each job in order, with any jobs left over split evenly
+bool parse_cat_masks(const char *option)
+{
+  char *end;
+  unsigned long mask;
+  
+  share_cache = true;
+  if (strcmp(option, "even") == 0)
+    return true;
+  
+  for (;;)
+  {
+    mask = strtoul(option, &end, 0);
+    if (end == option || mask == 0 || (CACHE_WAYS < (int)BITMAP_BITS && mask >> CACHE_WAYS))
+      return false;
+    cat_masks.push_back(mask);
+    
+    if (*end == '\0')
+      return true;
+    if (*end != ',')
+      return false;
+    option = end + 1;
+  }
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// cache processing routines 
+
+
+// makes a block one of the first find_block() checks, in place of the oldest
+static inline void remember_block(int block_id)
+{
+  if (use_lookaside)
+  {
+    machine->lookaside[machine->lookaside_next] = block_id;
+    machine->lookaside_next = (machine->lookaside_next + 1) % LOOKASIDE_BLOCKS;
+  }
+}
+
+
+// whether a line is all zeros
+static inline bool zero_line(const uint16_t *line)
+{
+  int i;
+  
+  for (i = 0; i < BLOCK_SIZE; i++)
+  {
+    if (line[i])
+      return false;
+  }
+  
+  return true;
+}
+
+// writes a given block to memory and makes the cache block available for use
+void write_block(int block_id)
+{
+  // make sure it's valid first...
+  if (machine->dictionary[block_id].valid)
+  {
+    // if it's dirty write the data
+    if (machine->dictionary[block_id].dirty)
+    {
+      // write the whole block back in one copy, or when we're sectored just the words that were written
+      // note that the tag is our memory block identifier!
+      if (sector_size == BLOCK_SIZE)
+      {
+        memcpy(machine->data[machine->dictionary[block_id].tag], machine->data_cache[block_id], sizeof(machine->data_cache[block_id]));
+        
+        // an all zero line only needs a flag sent, not its data
+        if (track_zero_lines && zero_line(machine->data_cache[block_id]))
+        {
+          machine->zero_writebacks++;
+          memory_write_zero(machine->dictionary[block_id].tag * BLOCK_SIZE);
+        }
+        else
+        {
+          machine->words_written_back += BLOCK_SIZE;
+          memory_write(machine->dictionary[block_id].tag * BLOCK_SIZE, BLOCK_SIZE);
+        }
+      }
+      else
+      {
+        unsigned long words = machine->dictionary[block_id].dirty_words;
+        int offset;
+        int written = 0;
+        
+        for (offset = 0; words; offset++, words >>= 1)
+        {
+          if (words & 1)
+          {
+            machine->data[machine->dictionary[block_id].tag][offset] = machine->data_cache[block_id][offset];
+            written++;
+          }
+        }
+        machine->words_written_back += written;
+        memory_write(machine->dictionary[block_id].tag * BLOCK_SIZE, written);
+      }
+      machine->cache_writebacks++;
+      machine->modified_blocks[machine->dictionary[block_id].tag / BITMAP_BITS].fetch_or(1UL << (machine->dictionary[block_id].tag % BITMAP_BITS),
+                                                                       std::memory_order_relaxed);
+    }
+    
+    // the block was only stored to silently, so it's still clean and there's nothing to write
+    else if (machine->dictionary[block_id].silent_words)
+    {
+      machine->silent_writebacks++;
+      machine->silent_bytes += WORD_SIZE * (sector_size == BLOCK_SIZE ? BLOCK_SIZE :
+                                            __builtin_popcountl(machine->dictionary[block_id].silent_words));
+    }
+    
+    // clear the dictionary
+    if (compression != COMPRESSION_NONE)
+      machine->lines_held--;
+    if (tag_indexed())
+      tag_index_remove(machine->dictionary[block_id].tag);
+    machine->dictionary[block_id].valid = false;
+    machine->dictionary[block_id].dirty = false;
+    machine->dictionary[block_id].dirty_words = 0;
+    machine->dictionary[block_id].silent_words = 0;
+    machine->dictionary[block_id].sectors = 0;
+    machine->dictionary[block_id].ref_count = 0;
+  }
+}
+
+
+// find the least recently used block in the set and writes it back to main memory
+// ARC makes its own choice, based on where arc_miss() found the block we're making room for,
+// and SHiP and Hawkeye go by their predictions
+// age is set to the victim's reference count
+int removeLRU(int set, int history, unsigned long &age)
+{
+  profile_stage(STAGE_REMOVE_LRU);
+  unsigned long LRU = ULONG_MAX;
+  int i;
+  int block_id = set * CACHE_WAYS;
+  
+  if (replacement_policy == POLICY_ARC)
+    block_id = arc_victim(set, history);
+  else if (replacement_policy == POLICY_SHIP || replacement_policy == POLICY_HAWKEYE)
+    block_id = rrip_victim(set);
+  
+  // find the LRU block
+  else
+  {
+    for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS; i++)
+    {
+      // make sure it's a valid block (should be redundant here...)
+      if (machine->dictionary[i].valid)
+      {
+        if (machine->dictionary[i].ref_count < LRU)
+        {
+          LRU = machine->dictionary[i].ref_count;
+          block_id = i;
+        }
+      }
+    }
+  }
+  age = machine->dictionary[block_id].ref_count;
+  
+  // write it back to memory
+  write_block(block_id);
+  
+  return block_id;
+}
+
+
+// evicts the least recently used blocks of a compressed set until it has room for this many more bytes
+// returns the number of blocks evicted
+int make_room(int set, int bytes)
+{
+  unsigned long age;
+  int evicted = 0;
+  
+  while (set_bytes(set) + bytes > SET_BYTES)
+  {
+    removeLRU(set, ARC_T1, age);
+    evicted++;
+  }
+  
+  return evicted;
+}
+
+
+// finds room for a block in a skewed cache and writes back whatever was there
+// the block can go in its row of any way -- we take a free one or the least recently used, and
+// with relocation we also consider moving one of those blocks to its row in another way
+int skew_victim(unsigned long tag)
+{
+  int candidates[CACHE_WAYS * CACHE_WAYS];
+  int parents[CACHE_WAYS * CACHE_WAYS];      // the candidate whose block moves out, -1 for the first level
+  int count = 0;
+  int best = 0;
+  int way, other, i;
+  
+  for (way = 0; way < CACHE_WAYS; way++)
+  {
+    candidates[count] = skew_set(tag, way) * CACHE_WAYS + way;
+    parents[count++] = -1;
+  }
+  
+  // the blocks in those places could move to their own rows in the other ways
+  for (i = 0; i < CACHE_WAYS && relocate_blocks; i++)
+  {
+    if (!machine->dictionary[candidates[i]].valid)
+      continue;
+    
+    for (other = 0; other < CACHE_WAYS; other++)
+    {
+      if (other != candidates[i] % CACHE_WAYS)
+      {
+        candidates[count] = skew_set(machine->dictionary[candidates[i]].tag, other) * CACHE_WAYS + other;
+        parents[count++] = i;
+      }
+    }
+  }
+  
+  // a free place beats the least recently used block, and there's no point moving a block if we don't have to
+  for (i = 0; i < count; i++)
+  {
+    const CacheEntry &entry = machine->dictionary[candidates[i]];
+    const CacheEntry &chosen = machine->dictionary[candidates[best]];
+    
+    if (chosen.valid && (!entry.valid || entry.ref_count < chosen.ref_count))
+      best = i;
+  }
+  
+  write_block(candidates[best]);
+  if (parents[best] == -1)
+    return candidates[best];
+  
+  // move the block along, leaving its old place free for the new one
+  memcpy(machine->data_cache[candidates[best]], machine->data_cache[candidates[parents[best]]], sizeof(machine->data_cache[0]));
+  machine->dictionary[candidates[best]] = machine->dictionary[candidates[parents[best]]];
+  machine->dictionary[candidates[parents[best]]].valid = false;
+  machine->relocations++;
+  
+  return candidates[parents[best]];
+}
+
+
+// pulls the given block from memory and places it into an available block of its set
+// pc is the MOVE that needs it
+int fetch_block(unsigned short tag, unsigned short pc)
+{
+  profile_stage(STAGE_FETCH_BLOCK);
+  int set = index_set(tag);
+  int i;
+  int block_id = 0;
+  bool found = false;
+  int history = ARC_T1;
+  unsigned long age = 0;
+  int size = LINE_BYTES;
+  
+  // ARC looks through its ghosts first, since finding the tag there changes what it replaces
+  if (replacement_policy == POLICY_ARC)
+    history = arc_miss(set, tag);
+  
+  // a compressed set needs room for the line's data as well as a free tag
+  if (compression != COMPRESSION_NONE)
+  {
+    size = compressed_size(machine->data[tag]);
+    make_room(set, size);
+    machine->compressed_fills++;
+    machine->compressed_bytes += size;
+  }
+  
+  // a skewed cache has its own way of finding room
+  if (index_function == INDEX_SKEW)
+  {
+    block_id = skew_victim(tag);
+    found = true;
+  }
+  
+  // find the first free block -- keeping a pointer would be more efficient
+  for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS && !found; i++)
+  {
+    if (machine->dictionary[i].valid == false)
+    {
+      block_id = i;
+      found = true;
+    }
+  }
+  
+  // if we didn't find a block, kill one
+  if (!found)
+    block_id = removeLRU(set, history, age);
+  
+  // load the required data in one copy -- when we're sectored, load_sector() brings in what's needed
+  // note that the tag is our memory block identifier!
+  if (sector_size == BLOCK_SIZE)
+  {
+    memcpy(machine->data_cache[block_id], machine->data[tag], sizeof(machine->data_cache[block_id]));
+    machine->dictionary[block_id].sectors = 1;
+    machine->words_filled += BLOCK_SIZE;
+    memory_read(tag * BLOCK_SIZE, BLOCK_SIZE);
+    if (track_zero_lines && zero_line(machine->data[tag]))
+      machine->zero_fills++;
+  }
+  
+  // indicate that it's available
+  machine->dictionary[block_id].valid = true;
+  machine->dictionary[block_id].dirty = false;
+  machine->dictionary[block_id].tag = tag;
+  machine->dictionary[block_id].list = history == ARC_T1 ? ARC_T1 : ARC_T2;
+  if (tag_indexed())
+    tag_index_fill(tag, block_id);
+  machine->dictionary[block_id].size = size;
+  if (compression != COMPRESSION_NONE)
+    machine->lines_held++;
+  
+  // new blocks are normally the most recently used, but bimodal insertion puts most of them where the victim was
+  machine->dictionary[block_id].ref_count = insert_at_lru(set) ? age : machine->current_ref_count;
+  
+  if (replacement_policy == POLICY_SHIP || replacement_policy == POLICY_HAWKEYE)
+    rrip_insert(block_id, pc);
+  
+  remember_block(block_id);
+  return block_id;
+}
+
+
+// looks for the tag in its set of the dictionary, the hard way
+static bool search_block(unsigned long tag, int &block_id)
+{
+  int set = index_set(tag);
+  bool found = false;
+  int way;
+  int i;
+  
+  // a skewed cache has to look in a different row for each way
+  if (index_function == INDEX_SKEW)
+  {
+    for (way = 0; way < CACHE_WAYS && !found; way++)
+    {
+      i = skew_set(tag, way) * CACHE_WAYS + way;
+      if (machine->dictionary[i].valid && machine->dictionary[i].tag == tag)
+      {
+        block_id = i;
+        found = true;
+      }
+    }
+    
+    return found;
+  }
+  
+  // a big fully associative cache looks the tag up instead
+  if (tag_indexed())
+  {
+    i = tag_index_find(tag);
+    if (i != -1)
+      block_id = machine->tag_blocks[i];
+    return i != -1;
+  }
+  
+  // simple linear search...
+  for (i = set * CACHE_WAYS; i < (set + 1) * CACHE_WAYS && !found; i++)
+  {
+    // make sure it's valid first!
+    if (machine->dictionary[i].valid)
+    {
+      if (machine->dictionary[i].tag == tag)
+      {
+        block_id = i;
+        found = true;
+      }
+    }
+  }
+  
+  return found;
+}
+
+// looks for the tag in the dictionary and sets the block id if found
+// consecutive accesses often want the same block, so the last blocks found are checked first --
+// a block that's been written back or moved since is no longer valid or has another tag, so that
+// can't find the wrong one, and the caller updates the replacement state the same either way
+bool find_block(unsigned long tag, int &block_id)
+{
+  profile_stage(STAGE_FIND_BLOCK);
+  int i;
+  
+  if (use_lookaside)
+  {
+    machine->lookups++;
+    for (i = 0; i < LOOKASIDE_BLOCKS; i++)
+    {
+      if (machine->dictionary[machine->lookaside[i]].tag == tag && machine->dictionary[machine->lookaside[i]].valid)
+      {
+        block_id = machine->lookaside[i];
+        machine->lookaside_hits++;
+        return true;
+      }
+    }
+  }
+  
+  if (!search_block(tag, block_id))
+    return false;
+  
+  remember_block(block_id);
+  return true;
+}
+
+
+// fills the sector holding the address if the block doesn't have it yet
+// returns true if it had to, meaning the access missed after all
+bool load_sector(int block_id, unsigned short addr)
+{
+  int sector = addr2sector(addr);
+  
+  if ((machine->dictionary[block_id].sectors >> sector) & 1)
+    return false;
+  
+  memcpy(&machine->data_cache[block_id][sector * sector_size], &machine->data[addr2tag(addr)][sector * sector_size],
+         sector_size * sizeof(machine->data_cache[block_id][0]));
+  machine->dictionary[block_id].sectors |= 1UL << sector;
+  machine->words_filled += sector_size;
+  memory_read(addr2tag(addr) * BLOCK_SIZE + sector * sector_size, sector_size);
+  
+  return true;
+}
+
+
+// finds the block holding the address for the MOVE at pc, bringing it in if required, and marks
+// it as the most recently used
+// returns the cache block id, or BYPASSED if the block skips the cache, and sets hit accordingly
+int cache_access(unsigned short addr, unsigned short pc, bool &hit)
+{
+  unsigned long tag = addr2tag(addr);
+  int block_id;
+  
+  if (replacement_policy == POLICY_HAWKEYE)
+    optgen_access(index_set(tag), tag, pc);
+  if (mrc_rate)
+    mrc_access(tag);
+  if (sweep)
+    sweep_access(tag);
+  if (lockstep.lanes)
+    lockstep_access(addr);
+  if (share_cache)
+    qos_access(tag);
+  
+  // if the block isn't in the cache, put it in -- that sets its reference count
+  hit = find_block(tag, block_id);
+  if (!hit)
+  {
+    block_id = bypass_block(pc) ? BYPASSED : fetch_block(tag, pc);
+    if (block_id != BYPASSED)
+      load_sector(block_id, addr);
+  }
+  
+  // we have a cache hit!
+  else
+  {
+    // up the block's reference count -- it's now been seen more than once
+    machine->dictionary[block_id].ref_count = machine->current_ref_count;
+    machine->dictionary[block_id].list = ARC_T2;
+    
+    if (replacement_policy == POLICY_SHIP || replacement_policy == POLICY_HAWKEYE)
+      rrip_hit(block_id, pc);
+    
+    // unless the block doesn't have the sector we need yet
+    if (load_sector(block_id, addr))
+    {
+      machine->sector_misses++;
+      hit = false;
+    }
+    else
+      machine->cache_hits++;
+    
+    // a compressed line has to be decompressed before we can use it
+    if (machine->dictionary[block_id].size < LINE_BYTES)
+    {
+      machine->decompression_cycles += compression == COMPRESSION_FPC ? FPC_LATENCY : BDI_LATENCY;
+      machine->cycle_count += compression == COMPRESSION_FPC ? FPC_LATENCY : BDI_LATENCY;
+    }
+  }
+  machine->current_ref_count++;
+  if (compression != COMPRESSION_NONE)
+    machine->line_samples += machine->lines_held;
+  
+  count_set_access(block_id == BYPASSED ? index_set(tag) : block_id / CACHE_WAYS, hit);
+  
+  if (replacement_policy == POLICY_DIP && (machine->current_ref_count - 1) % DUEL_WINDOW == 0)
+    tally_duel();
+  
+  return block_id;
+}
+
+
+// the word the access works on -- in memory itself if the access bypassed the cache
+static inline uint16_t &cached_word(int block_id, unsigned short addr)
+{
+  if (block_id == BYPASSED)
+    return machine->data[addr2tag(addr)][addr2offset(addr)];
+  
+  return machine->data_cache[block_id][addr2offset(addr)];
+}
+
+// loads a word -- if the access bypassed the cache, it comes from memory
+static inline uint16_t load_word(int block_id, unsigned short addr)
+{
+  if (block_id == BYPASSED)
+    memory_read(addr, 1);
+  
+  return cached_word(block_id, addr);
+}
+
+// stores a word, marking the block as having data to return to memory
+// a store that bypassed the cache has already been returned, so we mark it as written back instead
+static inline void store_word(int block_id, unsigned short addr, uint16_t value)
+{
+  // a store that leaves the word as it was doesn't make anything dirty
+  if (eliminate_silent_stores && cached_word(block_id, addr) == value)
+  {
+    machine->silent_stores++;
+    if (block_id != BYPASSED)
+      machine->dictionary[block_id].silent_words |= 1UL << addr2offset(addr);
+    return;
+  }
+  
+  cached_word(block_id, addr) = value;
+  
+  if (block_id == BYPASSED)
+  {
+    machine->modified_blocks[addr2tag(addr) / BITMAP_BITS].fetch_or(1UL << (addr2tag(addr) % BITMAP_BITS),
+                                                                    std::memory_order_relaxed);
+    memory_write(addr, 1);
+  }
+  else
+  {
+    machine->dictionary[block_id].dirty = true;
+    machine->dictionary[block_id].dirty_words |= 1UL << addr2offset(addr);
+    
+    // the line may not compress as well as it did, and other lines may have to go to make room
+    if (compression != COMPRESSION_NONE)
+    {
+      machine->dictionary[block_id].size = compressed_size(machine->data_cache[block_id]);
+      machine->growth_evictions += make_room(block_id / CACHE_WAYS, 0);
+    }
+  }
+}
+
+
+// adds an access to the trace being recorded, writing it out when the buffer fills
+void trace_access(unsigned char op, unsigned short value)
+{
+  trace_buffer[trace_count].pc = machine->state.PC;
+  trace_buffer[trace_count].addr = machine->state.MAR;
+  trace_buffer[trace_count].value = value;
+  trace_buffer[trace_count].op = op;
+  
+  if (++trace_count == TRACE_CHUNK)
+  {
+    fwrite(trace_buffer, sizeof(Access), trace_count, trace_file);
+    trace_count = 0;
+  }
+}
+
+
+// write the data (wrt the MAR/MDR) into the cache, fetching the block if required
+Phase cache_write()
+{
+  Phase rc = FETCH_INSTR;
+  int block_id;
+  bool hit;
+  
+  machine->access_count++;
+  if (trace_file)
+    trace_access(ACCESS_WRITE, machine->state.MDR);
+  
+  // make sure it's in range
+  // the MAR is a word address and the data size is in blocks...
+  if (machine->state.MAR < DATA_WORDS)
+  {
+    block_id = cache_access(machine->state.MAR, machine->state.PC, hit);
+    
+    // only a store that changes memory can change where the program goes
+    if (cached_word(block_id, machine->state.MAR) != machine->state.MDR)
+      machine->memory_generation++;
+    
+    // write the word, indicating that it has data to return to memory
+    store_word(block_id, machine->state.MAR, machine->state.MDR);
+    
+    if (access_observer)
+    {
+      Access access = { machine->state.PC, machine->state.MAR, machine->state.MDR, ACCESS_WRITE };
+      access_observer(access, hit);
+    }
+  }
+  else
+    rc = ILLEGAL_ADDRESS;
+  
+  return rc;
+}
+
+// read in the data from the cache and fetch from memory as required
+Phase cache_read()
+{
+  Phase rc = WRITE_BACK;
+  int block_id;
+  bool hit;
+  
+  machine->access_count++;
+  if (trace_file)
+    trace_access(ACCESS_READ, 0);
+  
+  // make sure it's in range
+  // the MAR is a word address and the data size is in blocks...
+  if (machine->state.MAR < DATA_WORDS)
+  {
+    block_id = cache_access(machine->state.MAR, machine->state.PC, hit);
+    
+    // read the word -- the cache is already in host endianness
+    machine->state.MDR = load_word(block_id, machine->state.MAR);
+    
+    if (access_observer)
+    {
+      Access access = { machine->state.PC, machine->state.MAR, machine->state.MDR, ACCESS_READ };
+      access_observer(access, hit);
+    }
+  }
+  else
+    rc = ILLEGAL_ADDRESS;
+  
+  return rc;
+}
+
+
+// hints the host to bring in what an upcoming access will touch: the set's dictionary entries
+// and the memory block we'd fill from on a miss
+static inline void prefetch_access(unsigned short addr)
+{
+  if (addr < DATA_WORDS)
+  {
+    prefetch(&machine->dictionary[index_set(addr2tag(addr)) * CACHE_WAYS]);
+    prefetch(machine->data[addr2tag(addr)]);
+  }
+}
+
+// carries out an access on the cache block holding it and counts it
+static inline void perform_access(Access &access, int block_id, bool hit, CacheStats &stats)
+{
+  if (access.op == ACCESS_WRITE)
+  {
+    store_word(block_id, access.addr, access.value);
+    stats.writes++;
+  }
+  else
+  {
+    access.value = load_word(block_id, access.addr);
+    stats.reads++;
+  }
+  
+  if (hit)
+    stats.hits++;
+  else
+    stats.misses++;
+}
+
+// processes a batch of accesses without going through the MAR/MDR, accumulating into stats
+// reads return their data in the value field of the access
+void cache_batch(Access *accesses, int count, CacheStats &stats)
+{
+  unsigned long start_writebacks = machine->cache_writebacks;
+  int block_id;
+  bool hit;
+  int i;
+  
+  // get the first few accesses on their way
+  for (i = 0; i < count && i < BATCH_PREFETCH; i++)
+    prefetch_access(accesses[i].addr);
+  
+  for (i = 0; i < count; i++)
+  {
+    Access &access = accesses[i];
+    
+    // keep the prefetches ahead of us
+    if (i + BATCH_PREFETCH < count)
+      prefetch_access(accesses[i + BATCH_PREFETCH].addr);
+    
+    if (access.addr >= DATA_WORDS)
+    {
+      stats.illegal++;
+      continue;
+    }
+    
+    block_id = cache_access(access.addr, access.pc, hit);
+    perform_access(access, block_id, hit, stats);
+  }
+  
+  stats.accesses += count;
+  stats.writebacks += machine->cache_writebacks - start_writebacks;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// shared cache routines
+//
+// When several replay threads share the cache, each access only owns the set its block maps to.
+// Every set has its own spinlock, on its own host cache line, so threads working on different
+// sets never wait on each other or share a line. find_block, fetch_block and the LRU all stay
+// within a set and a memory block only ever maps to one set, so everything they touch is covered
+// by that set's lock. A thread that finds the lock taken spins on plain loads with a pause,
+// backing off exponentially and then yielding, rather than hammering the line with CASes.
+//
+// The LRU only ever compares stamps within a set, so each set hands out its own stamps under its
+// lock, as each partition does for partition_batch(). With one thread every hit, miss and
+// replacement is exactly that of cache_batch(). With more threads the results depend on how the
+// accesses interleave.
+//
+// Nothing here helps threads sharing one set -- the default fully associative build has only
+// one, so its accesses are all serialised on that set's lock. Build with CACHE_WAYS below
+// CACHE_BLOCKS to give the threads sets to spread over.
+
+// waits a little before looking at a contended lock again
+static inline void back_off(unsigned int &spins)
+{
+  unsigned int i;
+  
+  if (spins >= SPIN_LIMIT)
+  {
+    std::this_thread::yield();
+    return;
+  }
+  
+  for (i = 0; i < spins; i++)
+  {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+  }
+  spins *= 2;
+}
+
+// takes ownership of a set, returning how many times we had to retry
+static inline unsigned long lock_set(int set)
+{
+  unsigned long retries = 0;
+  unsigned int spins = 1;
+  
+  while (set_locks[set].locked.exchange(true, std::memory_order_acquire))
+  {
+    // wait for it to look free before trying again, so the line stays shared while we wait
+    do
+    {
+      retries++;
+      back_off(spins);
+    }
+    while (set_locks[set].locked.load(std::memory_order_relaxed));
+  }
+  
+  return retries;
+}
+
+static inline void unlock_set(int set)
+{
+  set_locks[set].locked.store(false, std::memory_order_release);
+}
+
+// the shared cache's equivalent of cache_batch() -- safe to call from multiple threads at once
+// hits are only accumulated into stats, so callers must fold them into the totals
+void shared_cache_batch(Access *accesses, int count, CacheStats &stats)
+{
+  unsigned long tag;
+  int block_id = 0;
+  int set;
+  bool hit;
+  int i;
+  
+  for (i = 0; i < count; i++)
+  {
+    Access &access = accesses[i];
+    
+    if (i + BATCH_PREFETCH < count)
+      prefetch_access(accesses[i + BATCH_PREFETCH].addr);
+    
+    if (access.addr >= DATA_WORDS)
+    {
+      stats.illegal++;
+      continue;
+    }
+    
+    tag = addr2tag(access.addr);
+    set = index_set(tag);
+    stats.contended += lock_set(set);
+    
+    hit = find_block(tag, block_id);
+    if (!hit)
+      block_id = fetch_block(tag, access.pc);
+    if (load_sector(block_id, access.addr) && hit)
+    {
+      stats.sector_misses++;
+      hit = false;
+    }
+    machine->dictionary[block_id].ref_count = set_locks[set].stamp++;
+    count_set_access(set, hit);
+    perform_access(access, block_id, hit, stats);
+    
+    unlock_set(set);
+  }
+  
+  stats.accesses += count;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// partitioned replay routines
+//
+// The sets of the cache never interact, so a trace can be split up by set and each piece
+// simulated on its own thread without any locking. The reading thread deals each access to
+// the partition owning its set through that partition's queue. Each partition sees its sets'
+// accesses in trace order and the LRU only compares stamps within a set, so every partition
+// can keep its own stamp counter and the results are exactly those of a serial replay.
+
+// adds accesses to a partition's queue, waiting for the consumer when it's full
+static void queue_push(AccessQueue &queue, const Access *accesses, size_t count)
+{
+  size_t tail = queue.tail.load(std::memory_order_relaxed);
+  size_t i;
+  
+  for (i = 0; i < count; i++)
+  {
+    // publish what we have so far and let the consumer catch up
+    while (tail - queue.head.load(std::memory_order_acquire) == PARTITION_QUEUE)
+    {
+      queue.tail.store(tail, std::memory_order_release);
+      std::this_thread::yield();
+    }
+    
+    queue.slots[tail & (PARTITION_QUEUE - 1)] = accesses[i];
+    tail++;
+  }
+  
+  queue.tail.store(tail, std::memory_order_release);
+}
+
+// simulates accesses whose sets all belong to the calling partition
+static void partition_batch(Access *accesses, size_t count, CacheStats &stats, unsigned long &ref_count)
+{
+  unsigned long tag;
+  int block_id = 0;
+  bool hit;
+  size_t i;
+  
+  for (i = 0; i < count; i++)
+  {
+    if (i + BATCH_PREFETCH < count)
+      prefetch_access(accesses[i + BATCH_PREFETCH].addr);
+    
+    tag = addr2tag(accesses[i].addr);
+    hit = find_block(tag, block_id);
+    if (!hit)
+      block_id = fetch_block(tag, accesses[i].pc);
+    if (load_sector(block_id, accesses[i].addr) && hit)
+    {
+      stats.sector_misses++;
+      hit = false;
+    }
+    machine->dictionary[block_id].ref_count = ref_count++;
+    count_set_access(block_id / CACHE_WAYS, hit);
+    
+    perform_access(accesses[i], block_id, hit, stats);
+  }
+  
+  stats.accesses += count;
+}
+
+// drains a partition's queue until the producer is done
+static void partition_worker(AccessQueue &queue, const std::atomic<bool> &done, CacheStats &stats)
+{
+  unsigned long ref_count = machine->current_ref_count;
+  size_t head = queue.head.load(std::memory_order_relaxed);
+  size_t tail;
+  size_t start;
+  size_t end;
+  
+  for (;;)
+  {
+    tail = queue.tail.load(std::memory_order_acquire);
+    if (head == tail)
+    {
+      // only finish once we know nothing was added before the producer said it was done
+      if (done.load(std::memory_order_acquire) && head == queue.tail.load(std::memory_order_acquire))
+        break;
+      std::this_thread::yield();
+      continue;
+    }
+    
+    // work on the accesses in place, stopping at the end of the ring
+    start = head & (PARTITION_QUEUE - 1);
+    end = std::min(start + (tail - head), (size_t)PARTITION_QUEUE);
+    partition_batch(&queue.slots[start], end - start, stats, ref_count);
+    
+    head += end - start;
+    queue.head.store(head, std::memory_order_release);
+  }
+}
+
+// reads the trace in chunks and deals each access out to the partition owning its set
+void replay_partitioned(FILE *replay_file, int partitions, CacheStats &stats)
+{
+  static Access chunk[TRACE_CHUNK];
+  AccessQueue *queues;
+  vector< vector<Access> > staging(partitions);
+  vector<CacheStats> partition_stats(partitions, CacheStats());
+  vector<std::thread> workers;
+  std::atomic<bool> done(false);
+  size_t count;
+  size_t i;
+  int p;
+  
+  queues = new AccessQueue[partitions];
+  for (p = 0; p < partitions; p++)
+  {
+    queues[p].head = 0;
+    queues[p].tail = 0;
+    staging[p].reserve(TRACE_CHUNK);
+    workers.push_back(std::thread(partition_worker, std::ref(queues[p]), std::cref(done), std::ref(partition_stats[p])));
+  }
+  
+  while ((count = fread(chunk, sizeof(Access), TRACE_CHUNK, replay_file)) > 0)
+  {
+    for (i = 0; i < count; i++)
+    {
+      stats.accesses++;
+      if (chunk[i].addr >= DATA_WORDS)
+        stats.illegal++;
+      else
+        staging[index_set(addr2tag(chunk[i].addr)) % partitions].push_back(chunk[i]);
+    }
+    
+    for (p = 0; p < partitions; p++)
+    {
+      queue_push(queues[p], staging[p].data(), staging[p].size());
+      staging[p].clear();
+    }
+  }
+  
+  done.store(true, std::memory_order_release);
+  for (p = 0; p < partitions; p++)
+    workers[p].join();
+  delete [] queues;
+  
+  // fold everything back into the totals
+  for (p = 0; p < partitions; p++)
+  {
+    stats.reads += partition_stats[p].reads;
+    stats.writes += partition_stats[p].writes;
+    stats.hits += partition_stats[p].hits;
+    stats.misses += partition_stats[p].misses;
+    stats.sector_misses += partition_stats[p].sector_misses;
+  }
+  machine->cache_hits += stats.hits;
+  machine->sector_misses += stats.sector_misses;
+  machine->current_ref_count += stats.hits + stats.misses;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// run control routines
+//
+// A run ends when the program stops itself, when it would run forever, or when it uses up one of
+// the instruction, cycle or data access budgets given on the command line.
+//
+// Every infinite loop has to branch backwards, so we snapshot the PC, the registers and the memory
+// generation (which counts the stores that actually changed memory) at each backward branch. If a
+// snapshot repeats, nothing can have changed in between and the program will loop forever. A loop
+// that rewrites memory every time around (counting in a word, say) never repeats a snapshot, so
+// only the budgets stop it -- which is why there's an instruction budget unless -i 0 removes it.
+// Comparing against every earlier snapshot would need unbounded memory, so we use Brent's cycle
+// detection instead: we keep a single saved snapshot and move it forward each time the number of
+// branches since we saved it reaches the next power of two. This finds any repeating cycle within
+// about twice its length, however long the cycle is.
+
+// budget names for reporting
+static const char *budget_names[NUM_BUDGETS] =
+{
+  "instruction", "cycle", "data access"
+};
+
+// returns true if the program state at this backward branch means we're in an infinite loop
+bool detect_loop()
+{
+  LoopState current;
+  unsigned long hash = machine->state.PC;
+  int i;
+  
+  machine->backward_branches++;
+  
+  // hash the state so that most comparisons are a single compare
+  current.PC = machine->state.PC;
+  current.memory_generation = machine->memory_generation;
+  memcpy(current.registers, machine->registers, sizeof(machine->registers));
+  hash = hash * 0x100000001b3UL ^ machine->memory_generation;
+  for (i = 0; i < REGISTERS; i++)
+    hash = hash * 0x100000001b3UL ^ machine->registers[i];
+  current.hash = hash;
+  
+  if (machine->loop_length > 0 && current.hash == machine->loop_state.hash && current.PC == machine->loop_state.PC &&
+      current.memory_generation == machine->loop_state.memory_generation &&
+      memcmp(current.registers, machine->loop_state.registers, sizeof(machine->registers)) == 0)
+    return true;
+  
+  // time to move our saved snapshot forward
+  if (machine->loop_length == 0 || machine->loop_length == machine->loop_power)
+  {
+    machine->loop_state = current;
+    machine->loop_power *= 2;
+    machine->loop_length = 0;
+  }
+  machine->loop_length++;
+  
+  return false;
+}
+
+// checks our budgets at the end of each instruction, returning the phase to go on with
+Phase end_instruction()
+{
+  Phase rc = FETCH_INSTR;
+  unsigned long used[NUM_BUDGETS];
+  int i;
+  
+  machine->instruction_count++;
+  used[INSTRUCTION_BUDGET] = machine->instruction_count;
+  used[CYCLE_BUDGET] = machine->cycle_count;
+  used[ACCESS_BUDGET] = machine->access_count;
+  
+  for (i = 0; i < NUM_BUDGETS && rc == FETCH_INSTR; i++)
+  {
+    if (budgets[i] && used[i] >= budgets[i])
+    {
+      machine->exhausted_budget = i;
+      rc = BUDGET_EXHAUSTED;
+    }
+  }
+  
+  return rc;
+}
+
+// runs the control unit through a single instruction, returning the phase to carry on with
+// each phase takes a cycle
+Phase run_instruction()
+{
+  Phase current_phase = FETCH_INSTR;
+  
+  do
+  {
+    current_phase = control_unit[current_phase]();
+    machine->cycle_count++;
+  } while (current_phase != FETCH_INSTR && current_phase < NUM_PHASES);
+  
+  if (current_phase == FETCH_INSTR)
+    current_phase = end_instruction();
+  
+  return current_phase;
+}
+
+// prints how far the run got
+void print_run_statistics()
+{
+  printf("Executed %ld instructions in %ld cycles, with %ld data accesses and %ld backward branches.\n",
+         machine->instruction_count, machine->cycle_count, machine->access_count, machine->backward_branches);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// state processing routines -- note that they all have the same prototype
+
+// simply pulls the instruction from code memory, verifying the address first
+Phase fetch_instr()
+{
+  profile_stage(STAGE_FETCH_INSTR);
+  Phase rc = DECODE_INSTR;
+  
+  // make sure it's in range
+  if (machine->state.PC < CODE_SIZE)
+  {
+    // using the MAR/MDR seems really weird here since you can just use the PC to index code[]
+    // but, we have to do it the way the CPU would handle things...
+    machine->state.MAR = machine->state.PC;
+    machine->state.MDR = machine->code[machine->state.MAR][0];
+    machine->state.MDR <<= 8;
+    machine->state.MDR |= machine->code[machine->state.MAR][1];
+    
+    machine->state.IR[0] = (unsigned char)(machine->state.MDR >> 8);
+    machine->state.IR[1] = (unsigned char)(machine->state.MDR & 0x00ff);
+
+    if (show_phases)
+      printf("FETCH_INSTR: PC=%04x, IR=%02x%02x\n", machine->state.PC, machine->state.IR[0], machine->state.IR[1]);
+  }
+  else
+    rc = ILLEGAL_ADDRESS;
+  
+  return rc;
+}
+
+// pulls the opcode and addressing mode and verifies that the instruction is valid.
+// uses the instruction characterization to decide where to go next.
+Phase decode_instr()
+{
+  profile_stage(STAGE_DECODE_INSTR);
+  Phase rc = FETCH_OPERANDS;
+  
+  if (show_phases)
+    printf("DECODE_INSTR: IR=%02x%02x, Opcode=%d, Mode=%d\n", machine->state.IR[0], machine->state.IR[1], opcode(), mode());
+  
+  // validate the instruction before continuing
+  switch (opcode())
+  {
+    // valid modes are 000b and 001b
+    case ADD_OPCODE:
+    case SUB_OPCODE:
+    case AND_OPCODE:
+    case OR_OPCODE:
+    case XOR_OPCODE:
+    case SHIFT_OPCODE:
+      if (mode() > 1)
+        rc = ILLEGAL_OPCODE;
+      break;
+      
+    // invalid mode if the second bit is set
+    case MOVE_OPCODE:
+      if (mode() & 0x02)
+        rc = ILLEGAL_OPCODE;
+      else
+        rc = CALCULATE_EA;
+      break;
+      
+    // invalid mode if all 3 bits are set
+    case BRANCH_OPCODE:
+      if (mode() == 0x07)
+        rc = ILLEGAL_OPCODE;
+      break;
+      
+    // all other opcode values are invalid  
+    default:
+      rc = ILLEGAL_OPCODE;
+      break;
+  }
+  
+  return rc;
+}
+
+// effective address calculations are only required if we have to access memory
+// with the address placed in the MAR
+Phase calculate_ea()
+{
+  profile_stage(STAGE_CALCULATE_EA);
+  Phase rc = FETCH_OPERANDS;
+  unsigned char reg = 0xFF;
+  
+  // the first operand has our memory address
+  if (mode() & 0x04)
+  {
+    reg = get_reg1();
+  }
+  
+  // the second operand has our memory address
+  else if (mode() & 0x01)
+  {
+    reg = machine->state.IR[1] >> 2;
+    reg &= 0x0F;
+  }
+  
+  // load the address if we have a valid register
+  if (reg != 0xFF)
+  {
+    machine->state.MAR = machine->registers[reg];
+  }
+
+  if (show_phases)
+    printf("CALCULATE_EA: MAR=%04x, Reg=%d\n", machine->state.MAR, reg);
+  
+  return rc;
+}
+
+// uses the instruction and addressing mode to decide how to get the data
+Phase fetch_operands()
+{
+  profile_stage(STAGE_FETCH_OPERANDS);
+  Phase rc = EXECUTE_INSTR;
+  unsigned char reg;
+  
+  // operand 1 is always register contents...
+  // unless it's a MOVE, then it's a destination and doesn't need fetching
+  if (opcode() != MOVE_OPCODE)
+  {
+    reg = get_reg1();
+    machine->state.ALU_x = machine->registers[reg];
+  }
+  
+  // operand 2 is more complicated...
+  
+  // calculate a register value in case we need it
+  reg = machine->state.IR[1] >> 2;
+  reg &= 0x0F;
+  switch (opcode())
+  {
+    // depending on the mode, put register contents or the literal into the "register"
+    case ADD_OPCODE:
+    case SUB_OPCODE:
+    case AND_OPCODE:
+    case OR_OPCODE:
+    case XOR_OPCODE:
+      if (mode() == 0)
+        machine->state.ALU_y = extract_literal();
+      else
+        machine->state.ALU_y = machine->registers[reg];
+      break;
+      
+    // to simplify things we always put the data into the MDR, even for a literal to
+    // register transfer. 
+    case MOVE_OPCODE:
+      // no need to execute an instruction here
+      rc = WRITE_BACK;
+      
+      // copy in the literal or register contents
+      if ((mode() & 0x01) == 0)
+        machine->state.MDR = extract_literal();
+      else if (mode() & 0x04)
+        machine->state.MDR = machine->registers[reg];
+      
+      // otherwise, fetch from memory
+      else
+        rc = cache_read();
+      
+      break;
+      
+    // branches always have a literal, ignored for jumps...  
+    case BRANCH_OPCODE:
+      machine->state.ALU_y = extract_literal();
+      break;
+      
+    default:
+      break;
+  }
+
+  if (show_phases)
+    printf("FETCH_OPERANDS: ALU_x=%04x, ALU_y=%04x, MDR=%04x\n", machine->state.ALU_x, machine->state.ALU_y, machine->state.MDR);
+  
+  return rc;
+}
+
+// based on the opcode, performs the operation on the ALU inputs
+Phase execute_instr()
+{
+  profile_stage(STAGE_EXECUTE_INSTR);
+  Phase rc = WRITE_BACK;
+  
+  if (show_phases)
+    printf("EXECUTE_INSTR: Opcode=%d, ALU_x=%04x, ALU_y=%04x\n", opcode(), machine->state.ALU_x, machine->state.ALU_y);
+  
+  switch (opcode())
+  {
+    case ADD_OPCODE:
+      machine->state.ALU_z = (short)machine->state.ALU_x + (short)machine->state.ALU_y;
+      break;
+      
+    case SUB_OPCODE:
+      machine->state.ALU_z = (short)machine->state.ALU_x - (short)machine->state.ALU_y;
+      break;
+      
+    case AND_OPCODE:
+      machine->state.ALU_z = machine->state.ALU_x & machine->state.ALU_y;
+      break;
+      
+    case OR_OPCODE:
+      machine->state.ALU_z = machine->state.ALU_x | machine->state.ALU_y;
+      break;
+      
+    case XOR_OPCODE:
+      machine->state.ALU_z = machine->state.ALU_x ^ machine->state.ALU_y;
+      break;
+      
+    case SHIFT_OPCODE:
+      if (mode() == 0)
+        machine->state.ALU_z = machine->state.ALU_x >> 1;
+      else
+        machine->state.ALU_z = machine->state.ALU_x << 1;
+      break;
+      
+    // note that this is where my design is incomplete since I should do a branch
+    // over a couple of iterations or I need more registers going to the ALU
+    // Oh well, I consider this to be good enough :)  
+    case BRANCH_OPCODE:
+      // handle the jump separately since it's special
+      if (mode() == 0)
+      {
+        machine->state.ALU_z = machine->state.ALU_x;
+        
+        // check for infinite loops -- remember that the PC is incremented after the write back
+        if ((unsigned short)(machine->state.ALU_z + 1) <= machine->state.PC && detect_loop())
+          rc = INFINITE_LOOP;
+      }
+      else
+      {
+        bool branch = false;
+        
+        switch (mode())
+        {
+          // BEQ
+          case 1:
+            if ((short)machine->state.ALU_x == (short)machine->registers[0])
+              branch = true;
+            break;
+            
+          // BNE
+          case 2:
+            if ((short)machine->state.ALU_x != (short)machine->registers[0])
+              branch = true;
+            break;
+            
+          // BLT
+          case 3:
+            if ((short)machine->state.ALU_x < (short)machine->registers[0])
+              branch = true;
+            break;
+            
+          // BGT
+          case 4:
+            if ((short)machine->state.ALU_x > (short)machine->registers[0])
+              branch = true;
+            break;
+            
+          // BLE
+          case 5:
+            if ((short)machine->state.ALU_x <= (short)machine->registers[0])
+              branch = true;
+            break;
+            
+          // BGE
+          case 6:
+            if ((short)machine->state.ALU_x >= (short)machine->registers[0])
+              branch = true;
+            break;
+        }
+        
+        // we always update the PC, but it only changes if required
+        if (branch)
+        {
+          machine->state.ALU_z = machine->state.PC + machine->state.ALU_y - 1;
+          
+          // check for infinite loops -- remember that the PC is incremented after the write back
+          if ((unsigned short)(machine->state.ALU_z + 1) <= machine->state.PC && detect_loop())
+            rc = INFINITE_LOOP;
+        }
+        else
+          // still need the PC in ALU_z for write back...
+          machine->state.ALU_z = machine->state.PC;
+      }
+      break;
+      
+    default:
+      break;
+  }
+  
+  return rc;
+}
+
+// we will either write to a register, the PC or memory
+Phase write_back()
+{
+  profile_stage(STAGE_WRITE_BACK);
+  Phase rc = FETCH_INSTR;
+  // determine the register we may have to write into
+  unsigned char reg = get_reg1();
+  
+  if (show_phases)
+    printf("WRITE_BACK: Opcode=%d, ALU_z=%04x, Register=%d\n", opcode(), machine->state.ALU_z, reg);
+  
+  switch (opcode())
+  {
+    // always writing to a register
+    case ADD_OPCODE:
+    case SUB_OPCODE:
+    case AND_OPCODE:
+    case OR_OPCODE:
+    case XOR_OPCODE:
+    case SHIFT_OPCODE:
+      machine->registers[reg] = machine->state.ALU_z;
+      break;
+      
+    // update the PC, if no branch it will simply re-write itself  
+    case BRANCH_OPCODE:
+      machine->state.PC = machine->state.ALU_z;
+      break;
+      
+    case MOVE_OPCODE:
+      // do we put the contents of MDR into a register or memory?
+      if (mode() & 0x04)
+        // memory
+        rc = cache_write();
+      else
+      {
+        // register
+        machine->registers[reg] = machine->state.MDR;
+      }
+      break;
+      
+    default:
+      break;
+  }
+  
+  // don't forget to increment the program counter
+  machine->state.PC++;
+  
+  return rc;
+}
+
+////////////////////////////////////////////////////////////////////
+// memory dump routines
+//
+// Memory is formatted into one buffer using lookup tables for the hex digits and printable
+// characters and written out with a single fwrite(), rather than a printf() per word. A full dump
+// keeps the original layout; partial dumps put the word address at the start of each line.
+
+// the two hex digits for each byte value and the character we show for it
+static char hex_table[256][2];
+static char ascii_table[256];
+
+// checks the hex value to ensure it a printable ASCII character. If
+// it isn't, '.' is returned instead of itself
+char valid_ascii(unsigned char hex_value)
+{
+  if (hex_value < 0x21 || hex_value > 0x7e)
+    hex_value = '.';
+  
+  return (char)hex_value;
+}
+
+// fills in our formatting tables
+void build_dump_tables()
+{
+  static const char digits[] = "0123456789abcdef";
+  int i;
+  
+  for (i = 0; i < 256; i++)
+  {
+    hex_table[i][0] = digits[i >> 4];
+    hex_table[i][1] = digits[i & 0x0f];
+    ascii_table[i] = valid_ascii((unsigned char)i);
+  }
+}
+
+// formats the line of memory starting at the given word, returning the end of what we wrote
+static char *format_line(char *out, const uint16_t *words, int start, bool with_address)
+{
+  char *text;
+  int i;
+  
+  if (with_address)
+  {
+    memcpy(out, hex_table[start >> 8], 2);
+    memcpy(out + 2, hex_table[start & 0xff], 2);
+    out[4] = ':';
+    out[5] = ' ';
+    out += 6;
+  }
+  
+  // the ASCII goes after the hex, so we can fill in both in one pass
+  text = out + LINE_WORDS * 5 + 2;
+  for (i = 0; i < LINE_WORDS; i++)
+  {
+    // words are in host order, so print the high byte first to keep the big endian layout
+    uint16_t word = words[start + i];
+    
+    memcpy(out, hex_table[word >> 8], 2);
+    memcpy(out + 2, hex_table[word & 0xff], 2);
+    out[4] = ' ';
+    out += 5;
+    
+    *text++ = ascii_table[word >> 8];
+    *text++ = ascii_table[word & 0xff];
+  }
+  out[0] = '\t';
+  out[1] = '\'';
+  text[0] = '\'';
+  text[1] = '\n';
+  
+  return text + 2;
+}
+
+// returns true if any block on the line starting at the given word was written back
+static bool line_modified(int start)
+{
+  int block;
+  
+  for (block = start / BLOCK_SIZE; block <= (start + LINE_WORDS - 1) / BLOCK_SIZE; block++)
+  {
+    if (bitmap_test(machine->modified_blocks, block))
+      return true;
+  }
+  
+  return false;
+}
+
+// takes the data and prints it out in hexadecimal and ASCII form
+void print_memory()
+{
+  profile_stage(STAGE_PRINT_MEMORY);
+  const uint16_t *words = &machine->data[0][0];
+  vector<char> buffer((DATA_WORDS / LINE_WORDS) * LINE_CHARS);
+  char *out = buffer.data();
+  int line;
+  
+  if (dump_mode == DUMP_NONE)
+    return;
+  
+  // print each line that we've been asked for
+  for (line = 0; line + LINE_WORDS <= DATA_WORDS; line += LINE_WORDS)
+  {
+    switch (dump_mode)
+    {
+      case DUMP_ALL:
+        out = format_line(out, words, line, false);
+        break;
+        
+      case DUMP_MODIFIED:
+        if (line_modified(line))
+          out = format_line(out, words, line, true);
+        break;
+        
+      case DUMP_RANGE:
+        if (line + LINE_WORDS > dump_start && line <= dump_end)
+          out = format_line(out, words, line, true);
+        break;
+    }
+  }
+  
+  fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+}
+
+// writes the data area out as a big endian binary image, the same layout as the data file
+bool write_image(const char *filename)
+{
+  const uint16_t *words = &machine->data[0][0];
+  unsigned char image[DATA_WORDS * WORD_SIZE];
+  FILE *image_file = fopen(filename, "wb");
+  bool rc;
+  int i;
+  
+  if (!image_file)
+  {
+    printf("Failed to open image file %s.\n", filename);
+    return false;
+  }
+  
+  for (i = 0; i < DATA_WORDS; i++)
+  {
+    image[i * 2] = (unsigned char)(words[i] >> 8);
+    image[i * 2 + 1] = (unsigned char)(words[i] & 0xff);
+  }
+  
+  rc = (fwrite(image, 1, sizeof(image), image_file) == sizeof(image));
+  if (fclose(image_file) != 0)
+    rc = false;
+  if (!rc)
+    printf("Failed to write image file %s.\n", filename);
+  
+  return rc;
+}
+
+
+////////////////////////////////////////////////////////////////////
+// memory comparison routines
+//
+// Two runs (different cache configurations for instance) have to leave memory in the same state.
+// Rather than compare full dumps, each run reports a hash of the memory lines whose contents differ
+// from what was loaded. Only lines holding blocks that write_block() marked as written back can
+// differ, so that's all we look at. We hash lines rather than blocks so that the hash doesn't depend
+// on the block size. Runs can also save binary images (-b) which -x compares word by word.
+
+#define XXH_PRIME1    0x9E3779B185EBCA87UL
+#define XXH_PRIME2    0xC2B2AE3D27D4EB4FUL
+#define XXH_PRIME3    0x165667B19E3779F9UL
+#define XXH_PRIME4    0x85EBCA77C2B2AE63UL
+#define XXH_PRIME5    0x27D4EB2F165667C5UL
+
+#define rotl64( value, bits ) (((value) << (bits)) | ((value) >> (64 - (bits))))
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t value)
+{
+  acc ^= xxh_round(0, value);
+  return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// XXH64 of the given bytes, read in host order
+uint64_t xxhash64(const void *input, size_t length, uint64_t seed)
+{
+  const unsigned char *bytes = (const unsigned char *)input;
+  const unsigned char *end = bytes + length;
+  uint64_t hash;
+  uint64_t lane;
+  uint32_t half;
+  
+  if (length >= 32)
+  {
+    uint64_t v[4] = { seed + XXH_PRIME1 + XXH_PRIME2, seed + XXH_PRIME2, seed, seed - XXH_PRIME1 };
+    int i;
+    
+    for (; bytes + 32 <= end; bytes += 32)
+    {
+      for (i = 0; i < 4; i++)
+      {
+        memcpy(&lane, bytes + i * 8, 8);
+        v[i] = xxh_round(v[i], lane);
+      }
+    }
+    
+    hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    for (i = 0; i < 4; i++)
+      hash = xxh_merge(hash, v[i]);
+  }
+  else
+    hash = seed + XXH_PRIME5;
+  
+  hash += length;
+  
+  for (; bytes + 8 <= end; bytes += 8)
+  {
+    memcpy(&lane, bytes, 8);
+    hash ^= xxh_round(0, lane);
+    hash = rotl64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (bytes + 4 <= end)
+  {
+    memcpy(&half, bytes, 4);
+    hash ^= (uint64_t)half * XXH_PRIME1;
+    hash = rotl64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+    bytes += 4;
+  }
+  for (; bytes < end; bytes++)
+  {
+    hash ^= *bytes * XXH_PRIME5;
+    hash = rotl64(hash, 11) * XXH_PRIME1;
+  }
+  
+  // final avalanche
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME3;
+  hash ^= hash >> 32;
+  
+  return hash;
+}
+
+// remembers what memory looked like before we started
+void snapshot_memory()
+{
+  memcpy(machine->loaded_data, machine->data, sizeof(machine->data));
+}
+
+// hashes the lines that changed, chaining each one's hash into the next so the order and
+// addresses count too
+uint64_t hash_memory(int &changed_lines)
+{
+  const uint16_t *words = &machine->data[0][0];
+  const uint16_t *loaded_words = &machine->loaded_data[0][0];
+  uint64_t hash = 0;
+  int line;
+  
+  changed_lines = 0;
+  for (line = 0; line + LINE_WORDS <= DATA_WORDS; line += LINE_WORDS)
+  {
+    if (line_modified(line) && memcmp(&words[line], &loaded_words[line], LINE_LENGTH) != 0)
+    {
+      hash = xxhash64(&words[line], LINE_LENGTH, hash ^ (uint64_t)line);
+      changed_lines++;
+    }
+  }
+  
+  return hash;
+}
+
+// prints the hash of what changed
+void print_memory_hash()
+{
+  int changed_lines;
+  uint64_t hash = hash_memory(changed_lines);
+  
+  printf("Memory hash %016lx covers %d changed lines.\n\n", (unsigned long)hash, changed_lines);
+}
+
+// reads a binary image written by write_image()
+bool read_image(const char *filename, vector<unsigned char> &image)
+{
+  FILE *image_file = fopen(filename, "rb");
+  unsigned char chunk[4096];
+  size_t count;
+  
+  if (!image_file)
+  {
+    printf("Failed to open image file %s.\n", filename);
+    return false;
+  }
+  
+  image.clear();
+  while ((count = fread(chunk, 1, sizeof(chunk), image_file)) > 0)
+    image.insert(image.end(), chunk, chunk + count);
+  fclose(image_file);
+  
+  return true;
+}
+
+// compares two images a block at a time, listing the words that differ
+// returns true if they match
+bool diff_images(const char *first_filename, const char *second_filename)
+{
+  vector<unsigned char> first, second;
+  size_t block_bytes = BLOCK_SIZE * WORD_SIZE;
+  size_t length;
+  size_t offset, i;
+  unsigned long differences = 0;
+  unsigned long blocks = 0;
+  
+  if (!read_image(first_filename, first) || !read_image(second_filename, second))
+    return false;
+  
+  if (first.size() != second.size())
+    printf("The images are different sizes (%zu and %zu bytes), comparing the first %zu.\n",
+           first.size(), second.size(), std::min(first.size(), second.size()));
+  length = std::min(first.size(), second.size()) & ~(size_t)1;
+  
+  for (offset = 0; offset < length; offset += block_bytes)
+  {
+    size_t block_length = std::min(block_bytes, length - offset);
+    
+    // most blocks will match, so only look at the words when they don't
+    if (memcmp(&first[offset], &second[offset], block_length) == 0)
+      continue;
+    
+    blocks++;
+    for (i = offset; i < offset + block_length; i += WORD_SIZE)
+    {
+      if (first[i] == second[i] && first[i + 1] == second[i + 1])
+        continue;
+      
+      if (differences < DIFF_LIMIT)
+        printf("%04zx: %02x%02x %02x%02x\n", i / WORD_SIZE, first[i], first[i + 1], second[i], second[i + 1]);
+      differences++;
+    }
+  }
+  
+  if (differences > DIFF_LIMIT)
+    printf("...\n");
+  if (differences || first.size() != second.size())
+    printf("The images differ in %ld words across %ld blocks.\n", differences, blocks);
+  else
+    printf("The images match.\n");
+  
+  return differences == 0 && first.size() == second.size();
+}
+
+
+////////////////////////////////////////////////////////////////////
+// general routines
+
+// initializes us to get going
+void initialize_system()
+{
+  int i;
+  
+  machine->state.PC = 0;
+  machine->state.MDR = 0;
+  machine->state.MAR = 0;
+  machine->state.ALU_x = 0;
+  machine->state.ALU_y = 0;
+  machine->state.ALU_z = 0;
+  
+  // fill all of our code and data space
+  for (i = 0; i < CODE_SIZE; i++)
+  {
+    machine->code[i][0] = MEM_FILLER;
+    machine->code[i][1] = MEM_FILLER;
+  }
+  memset(machine->data, MEM_FILLER, sizeof(machine->data));
+  
+  // initialize our registers
+  for (i = 0; i < REGISTERS; i++)
+    machine->registers[i] = 0;
+  
+  // initialize our cache to be empty
+  for (i = 0; i < CACHE_BLOCKS; i++)
+  {
+    machine->dictionary[i].valid = false;
+    machine->dictionary[i].dirty = false;
+    machine->dictionary[i].tag = 0;
+    machine->dictionary[i].list = ARC_T1;
+    machine->dictionary[i].ref_count = 0;
+    machine->dictionary[i].reused = false;
+    machine->dictionary[i].rrpv = 0;
+    machine->dictionary[i].pc = 0;
+    machine->dictionary[i].sectors = 0;
+    machine->dictionary[i].dirty_words = 0;
+    machine->dictionary[i].silent_words = 0;
+    machine->dictionary[i].size = LINE_BYTES;
+  }
+  tag_index_rebuild();
+  memset(machine->lookaside, 0, sizeof(machine->lookaside));
+  machine->lookaside_next = 0;
+  
+  // and our replacement policies to know nothing about the program
+  memset(machine->arc_sets, 0, sizeof(machine->arc_sets));
+  machine->psel = PSEL_MAX / 2;
+  machine->bip_insertions = 0;
+  machine->duel_windows[0] = machine->duel_windows[1] = 0;
+  machine->lead_changes = 0;
+  machine->bip_leading = false;
+  
+  // every MOVE starts out expected to reuse its blocks, Hawkeye's only weakly
+  memset(machine->signatures, replacement_policy == POLICY_HAWKEYE ? HAWKEYE_FRIENDLY : 1, sizeof(machine->signatures));
+  machine->dead_predictions = 0;
+  machine->cache_bypasses = 0;
+  if (replacement_policy == POLICY_HAWKEYE)
+    machine->optgen.assign(1, OptGen());
+  else
+    machine->optgen.clear();
+  machine->opt_hits = 0;
+  machine->opt_accesses = 0;
+  memset(machine->set_accesses, 0, sizeof(machine->set_accesses));
+  memset(machine->set_misses, 0, sizeof(machine->set_misses));
+  machine->relocations = 0;
+  machine->compressed_fills = 0;
+  machine->compressed_bytes = 0;
+  machine->lines_held = 0;
+  machine->line_samples = 0;
+  machine->growth_evictions = 0;
+  machine->decompression_cycles = 0;
+  machine->bus_stall_cycles = 0;
+  machine->qos_program = 0;
+  
+  // the miss ratio curve starts out at the rate we were given, with nothing sampled
+  mrc.threshold = (unsigned long)(mrc_rate * MRC_MODULUS);
+  mrc.tracked = 0;
+  memset(mrc.histogram, 0, sizeof(mrc.histogram));
+  mrc.accesses = 0;
+  mrc.samples = 0;
+  
+  // so does the sweep
+  sweep_state.tracked = 0;
+  memset(sweep_state.histogram, 0, sizeof(sweep_state.histogram));
+  sweep_state.accesses = 0;
+  
+  // the DRAM starts out idle with every bank precharged
+  memset(&machine->dram, 0, sizeof(machine->dram));
+  for (i = 0; i < DRAM_CHANNELS * DRAM_RANKS * DRAM_BANKS; i++)
+    (&machine->dram.banks[0][0][0])[i].open_row = -1;
+  
+  // initialize all cache data -- not required but we'll see any bad references this way...
+  memset(machine->data_cache, MEM_FILLER, sizeof(machine->data_cache));
+  
+  // and start our counts over
+  machine->phase = FETCH_INSTR;
+  machine->cache_hits = 0;
+  machine->cache_writebacks = 0;
+  machine->words_filled = 0;
+  machine->words_written_back = 0;
+  machine->silent_stores = 0;
+  machine->silent_writebacks = 0;
+  machine->silent_bytes = 0;
+  machine->zero_fills = 0;
+  machine->zero_writebacks = 0;
+  machine->sector_misses = 0;
+  machine->lookups = 0;
+  machine->lookaside_hits = 0;
+  machine->current_ref_count = 1;
+  machine->instruction_count = 0;
+  machine->cycle_count = 0;
+  machine->access_count = 0;
+  machine->exhausted_budget = NUM_BUDGETS;
+  machine->memory_generation = 0;
+  machine->backward_branches = 0;
+  machine->loop_power = 1;
+  machine->loop_length = 0;
+  for (i = 0; i < (int)BITMAP_WORDS(DATA_SIZE); i++)
+    machine->modified_blocks[i] = 0;
+  
+  build_dump_tables();
+}
+
+// converts the passed string into binary form and inserts it into our data area
+// the file is big endian text, so reading each 4 digit value as a number maps it to host order
+// data_index is the next word to fill and is moved on past what we insert
+// assumes an even number of characters!!!
+void insert_data(string line, int &data_index)
+{
+  profile_stage(STAGE_INSERT_DATA);
+  unsigned int i;
+  unsigned short word;
+
+  for (i = 0; i < line.length(); i += 4)
+  {
+    if (data_index < DATA_WORDS)
+    {
+      sscanf(line.substr(i, 4).c_str(), "%04hx", &word);
+      machine->data[data_index / BLOCK_SIZE][data_index % BLOCK_SIZE] = word;
+      data_index++;
+    }
+    else
+    {
+      printf("Warning: Data exceeds allocated memory size.\n");
       break;
+    }
+  }
+}
+
+// reads in the file data and returns true if our code and data areas are ready for processing
+bool load_files(const char *code_filename, const char *data_filename)
+{
+  FILE *code_file = NULL;
+  std::ifstream data_file(data_filename);
+  string line;           // used to read in a line of text
+  bool rc = false;
+  
+  printf("Attempting to open code file: %s\n", code_filename);
+  code_file = fopen(code_filename, "rb");  // Changed "r" to "rb" for binary mode
+  
+  if (code_file)
+  {
+    printf("Code file opened successfully.\n");
+    size_t bytes_read = fread(machine->code, 1, CODE_SIZE * WORD_SIZE, code_file);
+    printf("Read %zu bytes from code file.\n", bytes_read);
+    
+    fclose(code_file);
+    
+    printf("Attempting to open data file: %s\n", data_filename);
+    if (data_file.is_open())
+    {
+      printf("Data file opened successfully.\n");
+      int line_count = 0;
+      int data_index = 0;
+      while (getline(data_file, line))
+      {
+        insert_data(line, data_index);
+        line_count++;
+      }
+      printf("Read %d lines from data file.\n", line_count);
+      data_file.close();
+      
+      rc = true;
+    }
+    else
+    {
+      printf("Failed to open data file.\n");
+    }
+  }
+  else
+  {
+    printf("Failed to open code file.\n");
+  }
+  
+  if (rc)
+  {
+    printf("Code memory contents:\n");
+    for (int i = 0; i < CODE_SIZE && i < 32; i += 2)
+    {
+      printf("%04x: %02x%02x\n", i, machine->code[i][0], machine->code[i][1]);
+    }
+    printf("...\n");
+
+    printf("Data memory contents:\n");
+    for (int i = 0; i < DATA_SIZE && i < 16; i++)
+    {
+      for (int j = 0; j < BLOCK_SIZE; j++)
+      {
+        printf("%04x: %04x ", i * BLOCK_SIZE + j, machine->data[i][j]);
+      }
+      printf("\n");
+    }
+    printf("...\n");
+  }
+  return rc;
+}
+
+// prints the hit rate for everything the cache has seen and the memory traffic it made
+void print_statistics()
+{
+  printf("There were a total of %ld cache hits and %ld cache misses, for a hit rate of %4.3f.\n",
+         machine->cache_hits, machine->current_ref_count - machine->cache_hits - 1,
+         (double)machine->cache_hits / (double)(machine->current_ref_count - 1));
+  if (sector_size < BLOCK_SIZE)
+    printf("%ld of the misses were to blocks that were missing the %d word sector.\n",
+           machine->sector_misses, sector_size);
+  if (use_lookaside && show_sets)
+    printf("%ld of the %ld lookups found their block among the last %d found.\n", machine->lookaside_hits,
+           machine->lookups, LOOKASIDE_BLOCKS);
+  if (show_traffic || eliminate_silent_stores || track_zero_lines)
+    printf("Memory traffic was %ld words filled and %ld words written back.\n",
+           machine->words_filled.load(), machine->words_written_back.load());
+  if (eliminate_silent_stores)
+    printf("%ld stores were silent, leaving %ld blocks clean that would have been written back (%ld bytes).\n",
+           machine->silent_stores.load(), machine->silent_writebacks.load(), machine->silent_bytes.load());
+  if (track_zero_lines)
+    printf("%ld of the lines filled and %ld written back were all zeros, so %ld bytes of writebacks were sent as a flag.\n",
+           machine->zero_fills.load(), machine->zero_writebacks.load(), machine->zero_writebacks.load() * BLOCK_SIZE * WORD_SIZE);
+  printf("\n");
+  print_set_usage();
+  print_compression_statistics();
+  print_dram_statistics();
+  print_bus_statistics(machine->cycle_count);
+  print_miss_ratio_curve();
+  print_sweep();
+  print_hierarchies();
+  print_lockstep();
+}
+
+// replays the trace with several threads sharing the cache
+// the trace is read in up front and the threads pull chunks of it in turn
+void replay_shared(FILE *replay_file, int threads, CacheStats &stats)
+{
+  vector<Access> trace;
+  vector<CacheStats> thread_stats(threads, CacheStats());
+  vector<std::thread> workers;
+  std::atomic<size_t> next_chunk(0);
+  size_t count;
+  int i;
+  
+  trace.resize(TRACE_CHUNK);
+  while ((count = fread(&trace[trace.size() - TRACE_CHUNK], sizeof(Access), TRACE_CHUNK, replay_file)) == TRACE_CHUNK)
+    trace.resize(trace.size() + TRACE_CHUNK);
+  trace.resize(trace.size() - TRACE_CHUNK + count);
+  
+  for (i = 0; i < CACHE_SETS; i++)
+    set_locks[i].stamp = machine->current_ref_count;
+  for (i = 0; i < threads; i++)
+  {
+    workers.push_back(std::thread([&, i]()
+    {
+      size_t start;
       
+      while ((start = next_chunk.fetch_add(TRACE_CHUNK)) < trace.size())
+        shared_cache_batch(&trace[start], (int)std::min((size_t)TRACE_CHUNK, trace.size() - start), thread_stats[i]);
+    }));
+  }
+  for (i = 0; i < threads; i++)
+    workers[i].join();
+  
+  // fold everything back into the totals
+  for (i = 0; i < threads; i++)
+  {
+    stats.accesses += thread_stats[i].accesses;
+    stats.reads += thread_stats[i].reads;
+    stats.writes += thread_stats[i].writes;
+    stats.hits += thread_stats[i].hits;
+    stats.misses += thread_stats[i].misses;
+    stats.illegal += thread_stats[i].illegal;
+    stats.contended += thread_stats[i].contended;
+    stats.sector_misses += thread_stats[i].sector_misses;
+  }
+  machine->cache_hits += stats.hits;
+  machine->sector_misses += stats.sector_misses;
+  
+  // every access that reached a set took one stamp, whichever set's counter it came from
+  machine->current_ref_count += stats.accesses - stats.illegal;
+}
+
+// runs a recorded trace through the cache in batches and reports the totals
+// with more than one thread the cache is either shared between them or split up by set
+bool replay_trace(const char *trace_filename, int threads, bool partitioned)
+{
+  static Access batch[TRACE_CHUNK];
+  CacheStats stats = {};
+  FILE *replay_file = fopen(trace_filename, "rb");
+  size_t count;
+  int partitions = 0;
+  int i;
+  
+  if (!replay_file)
+  {
+    printf("Failed to open trace file %s.\n", trace_filename);
+    return false;
+  }
+  
+  if (partitioned)
+  {
+    // there's no point having more partitions than sets
+    partitions = std::min(threads, CACHE_SETS);
+    replay_partitioned(replay_file, partitions, stats);
+  }
+  else if (threads > 1)
+    replay_shared(replay_file, threads, stats);
+  else
+  {
+    while ((count = fread(batch, sizeof(Access), TRACE_CHUNK, replay_file)) > 0)
+      cache_batch(batch, (int)count, stats);
+  }
+  fclose(replay_file);
+  
+  // write back the contents of the cache
+  for (i = 0; i < CACHE_BLOCKS; i++)
+    write_block(i);
+  
+  printf("Replayed %ld accesses (%ld reads, %ld writes, %ld illegal addresses) with %ld writebacks.\n",
+         stats.accesses, stats.reads, stats.writes, stats.illegal, machine->cache_writebacks.load());
+  if (partitioned && partitions < threads)
+    printf("The sets were split between %d thread%s (of %d asked for) -- the cache has %d set%s.\n", partitions,
+           partitions == 1 ? "" : "s", threads, CACHE_SETS, CACHE_SETS == 1 ? "" : "s");
+  else if (partitioned)
+    printf("The sets were split between %d thread%s.\n", partitions, partitions == 1 ? "" : "s");
+  else if (threads > 1)
+    printf("%d threads shared the cache, waiting on a set %ld times.\n", threads, stats.contended);
+  print_statistics();
+  print_policy_statistics();
+  print_memory_hash();
+  print_profile();
+  
+  return true;
+}
+
+// picks the replacement policy by name, returning false if there's no such policy
+bool parse_policy(const char *option)
+{
+  int policy;
+  
+  for (policy = 0; policy < NUM_POLICIES; policy++)
+  {
+    if (strcmp(option, policy_names[policy]) == 0)
+    {
+      replacement_policy = policy;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+// picks the index function by name, returning false if there's no such function
+bool parse_index(const char *option)
+{
+  int function;
+  
+  for (function = 0; function < NUM_INDEX_FUNCTIONS; function++)
+  {
+    if (strcmp(option, index_names[function]) == 0)
+    {
+      index_function = function;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+// picks the compression algorithm by name, returning false if there's no such algorithm
+bool parse_compression(const char *option)
+{
+  int algorithm;
+  
+  for (algorithm = 0; algorithm < NUM_COMPRESSION_ALGORITHMS; algorithm++)
+  {
+    if (strcmp(option, compression_names[algorithm]) == 0)
+    {
+      compression = algorithm;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+// picks the DRAM page policy by name, returning false if there's no such policy
+bool parse_page_policy(const char *option)
+{
+  int policy;
+  
+  for (policy = 0; policy < NUM_PAGE_POLICIES; policy++)
+  {
+    if (strcmp(option, page_names[policy]) == 0)
+    {
+      page_policy = policy;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+// sets the sector size, returning false unless it's a whole number of sectors to a block that
+// we can keep a bit for each word of
+bool parse_sector_size(const char *option)
+{
+  int size = atoi(option);
+  
+  if (size <= 0 || BLOCK_SIZE % size != 0 || BLOCK_SIZE > (int)BITMAP_BITS)
+    return false;
+  
+  sector_size = size;
+  show_traffic = true;
+  return true;
+}
+
+// works out what we're dumping at the end of a run, returning false if we can't make sense of it
+bool parse_dump(const char *option)
+{
+  int start, end;
+  
+  if (strcmp(option, "all") == 0)
+    dump_mode = DUMP_ALL;
+  else if (strcmp(option, "modified") == 0)
+    dump_mode = DUMP_MODIFIED;
+  else if (strcmp(option, "none") == 0)
+    dump_mode = DUMP_NONE;
+  else if (sscanf(option, "%i:%i", &start, &end) == 2 && start >= 0 && start <= end && end < DATA_WORDS)
+  {
+    dump_mode = DUMP_RANGE;
+    dump_start = start;
+    dump_end = end;
+  }
+  else
+    return false;
+  
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// differential testing routines
+//
+// With -v the control unit runs in lockstep with a separate reference interpreter and a reference
+// copy of the original ref_count LRU cache. After every instruction we compare the PC and the
+// registers, every data access must go to the same address with the same data and get the same
+// hit or miss, and every store must leave the same word in memory (read through the cache). At the
+// end the written back data area must match the reference memory. The first divergence is
+// reported along with the last few instructions. -f does the same for random programs.
+
+// our view of one engine's instruction for reporting
+struct HISTORY_ENTRY
+{
+  unsigned short PC;
+  unsigned char  IR[2];
+};
+
+typedef struct HISTORY_ENTRY HistoryEntry;
+
+static ReferenceMachine reference;
+static ReferenceCache reference_cache;
+
+// what the control unit did for the current instruction
+static Access engine_access;
+static bool engine_hit;
+static int engine_accesses;
+
+// records the control unit's data accesses
+static void observe_access(const Access &access, bool hit)
+{
+  engine_access = access;
+  engine_hit = hit;
+  engine_accesses++;
+}
+
+// writes out an instruction in assembler form
+static void disassemble(const unsigned char IR[2], char *text)
+{
+  static const char *names[NUM_OPCODES] = { "ADD", "SUB", "AND", "OR", "XOR", "MOVE", "SHIFT", "BRANCH" };
+  static const char *branches[7] = { "JMP", "BEQ", "BNE", "BLT", "BGT", "BLE", "BGE" };
+  int op = IR[0] >> 5;
+  int how = (IR[0] >> 2) & 0x07;
+  int reg1 = (((IR[0] & 0x03) << 2) | (IR[1] >> 6)) & 0x0F;
+  int reg2 = (IR[1] >> 2) & 0x0F;
+  int literal = (IR[1] & 0x20) ? (IR[1] & 0x3F) - 64 : (IR[1] & 0x3F);
+  
+  if (op == MOVE_OPCODE && how == 0)
+    sprintf(text, "MOVE R%d,%d", reg1, literal);
+  else if (op == MOVE_OPCODE && how == 1)
+    sprintf(text, "MOVE R%d,[R%d]", reg1, reg2);
+  else if (op == MOVE_OPCODE && how == 4)
+    sprintf(text, "MOVE [R%d],%d", reg1, literal);
+  else if (op == MOVE_OPCODE && how == 5)
+    sprintf(text, "MOVE [R%d],R%d", reg1, reg2);
+  else if (op == SHIFT_OPCODE)
+    sprintf(text, "%s R%d", how ? "SHL" : "SHR", reg1);
+  else if (op == BRANCH_OPCODE && how < 7)
+    sprintf(text, "%s R%d,%d", branches[how], reg1, literal);
+  else if (op < MOVE_OPCODE && how == 0)
+    sprintf(text, "%s R%d,%d", names[op], reg1, literal);
+  else if (op < MOVE_OPCODE && how == 1)
+    sprintf(text, "%s R%d,R%d", names[op], reg1, reg2);
+  else
+    sprintf(text, "illegal %02x%02x", IR[0], IR[1]);
+}
+
+// the reference interpreter: executes the instruction at the PC, recording any data access
+// this deliberately doesn't share any code with the control unit
+int reference_step(ReferenceMachine &model)
+{
+  unsigned char IR[2];
+  int op, how, reg1, reg2;
+  unsigned short literal;
+  unsigned short x, y;
+  bool taken = false;
+  
+  model.accesses = 0;
+  if (model.PC >= CODE_SIZE)
+    return REFERENCE_ILLEGAL_ADDRESS;
+  
+  IR[0] = machine->code[model.PC][0];
+  IR[1] = machine->code[model.PC][1];
+  op = IR[0] >> 5;
+  how = (IR[0] >> 2) & 0x07;
+  reg1 = (((IR[0] & 0x03) << 2) | (IR[1] >> 6)) & 0x0F;
+  reg2 = (IR[1] >> 2) & 0x0F;
+  
+  // literals are sign extended through a char, just like the processor does it
+  char value = IR[1] & 0x3F;
+  if (value & 0x20)
+    value |= 0xC0;
+  literal = value;
+  
+  x = model.registers[reg1];
+  switch (op)
+  {
+    case ADD_OPCODE:
+    case SUB_OPCODE:
     case AND_OPCODE:
-      state.ALU_z = state.ALU_x & state.ALU_y;
-      break;
-      
     case OR_OPCODE:
-      state.ALU_z = state.ALU_x | state.ALU_y;
-      break;
-      
     case XOR_OPCODE:
-      state.ALU_z = state.ALU_x ^ state.ALU_y;
+      if (how > 1)
+        return REFERENCE_ILLEGAL_OPCODE;
+      y = how ? model.registers[reg2] : literal;
+      if (op == ADD_OPCODE)
+        model.registers[reg1] = (short)x + (short)y;
+      else if (op == SUB_OPCODE)
+        model.registers[reg1] = (short)x - (short)y;
+      else if (op == AND_OPCODE)
+        model.registers[reg1] = x & y;
+      else if (op == OR_OPCODE)
+        model.registers[reg1] = x | y;
+      else
+        model.registers[reg1] = x ^ y;
       break;
       
     case SHIFT_OPCODE:
-      if (mode() == 0)
-        state.ALU_z = state.ALU_x >> 1;
-      else
-        state.ALU_z = state.ALU_x << 1;
+      if (how > 1)
+        return REFERENCE_ILLEGAL_OPCODE;
+      model.registers[reg1] = how ? (unsigned short)(x << 1) : (unsigned short)(x >> 1);
       break;
       
-    // note that this is where my design is incomplete since I should do a branch
-    // over a couple of iterations or I need more registers going to the ALU
-    // Oh well, I consider this to be good enough :)  
-    case BRANCH_OPCODE:
-      // handle the jump separately since it's special
-      if (mode() == 0)
+    case MOVE_OPCODE:
+      if (how & 0x02)
+        return REFERENCE_ILLEGAL_OPCODE;
+      
+      // a load
+      if (how == 1)
       {
-        state.ALU_z = state.ALU_x;
-        
-        // check for infinite loops
-        branch_count++;
-        if (branch_count > BRANCH_LIMIT)
-          rc = INFINITE_LOOP;
+        Access &access = model.access[model.accesses++];
+        access.pc = model.PC;
+        access.addr = model.registers[reg2];
+        access.op = ACCESS_READ;
+        if (access.addr >= DATA_WORDS)
+          return REFERENCE_ILLEGAL_ADDRESS;
+        access.value = model.memory[access.addr];
+        model.registers[reg1] = access.value;
       }
-      else
+      
+      // a store -- note that the PC still moves on if the address is bad
+      else if (how & 0x04)
       {
-        bool branch = false;
-        
-        switch (mode())
-        {
-          // BEQ
-          case 1:
-            if ((short)state.ALU_x == (short)registers[0])
-              branch = true;
-            break;
-            
-          // BNE
-          case 2:
-            if ((short)state.ALU_x != (short)registers[0])
-              branch = true;
-            break;
-            
-          // BLT
-          case 3:
-            if ((short)state.ALU_x < (short)registers[0])
-              branch = true;
-            break;
-            
-          // BGT
-          case 4:
-            if ((short)state.ALU_x > (short)registers[0])
-              branch = true;
-            break;
-            
-          // BLE
-          case 5:
-            if ((short)state.ALU_x <= (short)registers[0])
-              branch = true;
-            break;
-            
-          // BGE
-          case 6:
-            if ((short)state.ALU_x >= (short)registers[0])
-              branch = true;
-            break;
-        }
-        
-        // we always update the PC, but it only changes if required
-        if (branch)
+        Access &access = model.access[model.accesses++];
+        access.pc = model.PC;
+        access.addr = x;
+        access.value = (how & 0x01) ? model.registers[reg2] : literal;
+        access.op = ACCESS_WRITE;
+        if (access.addr >= DATA_WORDS)
         {
-          state.ALU_z = state.PC + state.ALU_y - 1;
-          
-          // check for infinite loops
-          branch_count++;
-          if (branch_count > BRANCH_LIMIT)
-            rc = INFINITE_LOOP;
+          model.PC++;
+          return REFERENCE_ILLEGAL_ADDRESS;
         }
-        else
-          // still need the PC in ALU_z for write back...
-          state.ALU_z = state.PC;
+        model.memory[access.addr] = access.value;
       }
+      else
+        model.registers[reg1] = literal;
       break;
       
-    default:
+    case BRANCH_OPCODE:
+      if (how == 7)
+        return REFERENCE_ILLEGAL_OPCODE;
+      
+      // jumps go to the instruction after the one in the register
+      if (how == 0)
+      {
+        model.PC = x + 1;
+        return REFERENCE_OK;
+      }
+      
+      switch (how)
+      {
+        case 1: taken = (short)x == (short)model.registers[0]; break;
+        case 2: taken = (short)x != (short)model.registers[0]; break;
+        case 3: taken = (short)x <  (short)model.registers[0]; break;
+        case 4: taken = (short)x >  (short)model.registers[0]; break;
+        case 5: taken = (short)x <= (short)model.registers[0]; break;
+        case 6: taken = (short)x >= (short)model.registers[0]; break;
+      }
+      if (taken)
+      {
+        model.PC += literal;
+        return REFERENCE_OK;
+      }
       break;
   }
   
-  return rc;
+  model.PC++;
+  return REFERENCE_OK;
 }
 
-// we will either write to a register, the PC or memory
-Phase write_back()
+// returns true if the cache is configured the way the reference cache works -- LRU within sets
+// of CACHE_WAYS blocks -- so that they should agree on every hit and miss
+static bool reference_cache_applies()
 {
-  Phase rc = FETCH_INSTR;
-  // determine the register we may have to write into
-  unsigned char reg = get_reg1();
-  
-  printf("WRITE_BACK: Opcode=%d, ALU_z=%04x, Register=%d\n", opcode(), state.ALU_z, reg);
+  return replacement_policy == POLICY_LRU && index_function != INDEX_SKEW && compression == COMPRESSION_NONE;
+}
+
+// the reference cache: returns whether the access hits, bringing the block in if it doesn't
+bool reference_cache_access(ReferenceCache &cache, unsigned short addr)
+{
+  unsigned long tag = addr / BLOCK_SIZE;
+  unsigned long sector = 1UL << ((addr % BLOCK_SIZE) / sector_size);
+  int first = index_set(tag) * CACHE_WAYS;
+  int victim = -1;
+  int i;
   
-  switch (opcode())
+  // a block without the sector still misses
+  for (i = first; i < first + CACHE_WAYS; i++)
   {
-    // always writing to a register
-    case ADD_OPCODE:
-    case SUB_OPCODE:
-    case AND_OPCODE:
-    case OR_OPCODE:
-    case XOR_OPCODE:
-    case SHIFT_OPCODE:
-      registers[reg] = state.ALU_z;
-      break;
+    if (cache.valid[i] && cache.tag[i] == tag)
+    {
+      cache.ref_count[i] = cache.current_ref_count++;
+      if (cache.sectors[i] & sector)
+        return true;
       
-    // update the PC, if no branch it will simply re-write itself  
-    case BRANCH_OPCODE:
-      state.PC = state.ALU_z;
+      cache.sectors[i] |= sector;
+      return false;
+    }
+  }
+  
+  // the first empty block, otherwise the least recently used one
+  for (i = first; i < first + CACHE_WAYS && victim == -1; i++)
+  {
+    if (!cache.valid[i])
+      victim = i;
+  }
+  if (victim == -1)
+  {
+    victim = first;
+    for (i = first + 1; i < first + CACHE_WAYS; i++)
+    {
+      if (cache.ref_count[i] < cache.ref_count[victim])
+        victim = i;
+    }
+  }
+  
+  cache.valid[victim] = true;
+  cache.tag[victim] = tag;
+  cache.sectors[victim] = sector;
+  cache.ref_count[victim] = cache.current_ref_count++;
+  
+  return false;
+}
+
+// reads a word as the program sees it, from the cache if it's there
+static uint16_t engine_word(unsigned short addr)
+{
+  int block_id;
+  
+  if (find_block(addr2tag(addr), block_id) && ((machine->dictionary[block_id].sectors >> addr2sector(addr)) & 1))
+    return machine->data_cache[block_id][addr2offset(addr)];
+  
+  return machine->data[addr2tag(addr)][addr2offset(addr)];
+}
+
+// maps the control unit's stopping phase onto the reference results
+static int engine_result(Phase phase)
+{
+  if (phase == ILLEGAL_OPCODE)
+    return REFERENCE_ILLEGAL_OPCODE;
+  if (phase == ILLEGAL_ADDRESS)
+    return REFERENCE_ILLEGAL_ADDRESS;
+  
+  return REFERENCE_OK;
+}
+
+// prints both sides of a divergence along with the instructions leading up to it
+static void report_divergence(const char *what, const HistoryEntry *history, unsigned long step)
+{
+  char text[32];
+  unsigned long i;
+  int reg;
+  
+  printf("Divergence at instruction %ld: %s\n", step, what);
+  printf("Last instructions:\n");
+  for (i = (step >= HISTORY_LENGTH ? step - HISTORY_LENGTH + 1 : 0); i <= step; i++)
+  {
+    disassemble(history[i % HISTORY_LENGTH].IR, text);
+    printf("  %6ld  %04x: %02x%02x  %s\n", i, history[i % HISTORY_LENGTH].PC,
+           history[i % HISTORY_LENGTH].IR[0], history[i % HISTORY_LENGTH].IR[1], text);
+  }
+  
+  printf("             PC  ");
+  for (reg = 0; reg < REGISTERS; reg++)
+    printf(" R%-3d", reg);
+  printf("\nengine:      %04x", machine->state.PC);
+  for (reg = 0; reg < REGISTERS; reg++)
+    printf(" %04x", machine->registers[reg]);
+  printf("\nreference:   %04x", reference.PC);
+  for (reg = 0; reg < REGISTERS; reg++)
+    printf(" %04x", reference.registers[reg]);
+  printf("\n");
+  if (engine_accesses || reference.accesses)
+  {
+    printf("engine access:    %s %04x=%04x %s\n", engine_accesses ? (engine_access.op == ACCESS_WRITE ? "write" : "read") : "none",
+           engine_access.addr, engine_access.value, engine_hit ? "hit" : "miss");
+    printf("reference access: %s %04x=%04x\n", reference.accesses ? (reference.access[0].op == ACCESS_WRITE ? "write" : "read") : "none",
+           reference.access[0].addr, reference.access[0].value);
+  }
+  printf("\n");
+}
+
+// runs whatever is loaded through the control unit and the reference in lockstep
+// returns true if they agree all the way through
+bool run_differential(unsigned long limit)
+{
+  HistoryEntry history[HISTORY_LENGTH];
+  Phase phase = FETCH_INSTR;
+  int result = REFERENCE_OK;
+  unsigned long step;
+  char what[96];
+  bool reference_hit;
+  int reg;
+  int i;
+  
+  // both sides start from whatever has been loaded
+  memset(&reference, 0, sizeof(reference));
+  memcpy(reference.memory, machine->data, sizeof(reference.memory));
+  memset(&reference_cache, 0, sizeof(reference_cache));
+  reference_cache.current_ref_count = 1;
+  access_observer = observe_access;
+  
+  for (step = 0; step < limit && phase < NUM_PHASES; step++)
+  {
+    history[step % HISTORY_LENGTH].PC = machine->state.PC;
+    history[step % HISTORY_LENGTH].IR[0] = machine->state.PC < CODE_SIZE ? machine->code[machine->state.PC][0] : 0xFF;
+    history[step % HISTORY_LENGTH].IR[1] = machine->state.PC < CODE_SIZE ? machine->code[machine->state.PC][1] : 0xFF;
+    
+    engine_accesses = 0;
+    phase = run_instruction();
+    result = reference_step(reference);
+    
+    // the control unit might have decided it's in a loop first -- that's a fine place to stop
+    if (phase == INFINITE_LOOP || phase == BUDGET_EXHAUSTED)
       break;
-      
-    case MOVE_OPCODE:
-      // do we put the contents of MDR into a register or memory?
-      if (mode() & 0x04)
-        // memory
-        rc = cache_write();
+    
+    if (engine_result(phase) != result)
+    {
+      sprintf(what, "the engine %s but the reference %s",
+              phase == ILLEGAL_OPCODE ? "hit an illegal opcode" : phase == ILLEGAL_ADDRESS ? "hit an illegal address" : "carried on",
+              result == REFERENCE_ILLEGAL_OPCODE ? "hit an illegal opcode" :
+              result == REFERENCE_ILLEGAL_ADDRESS ? "hit an illegal address" : "carried on");
+      report_divergence(what, history, step);
+      access_observer = NULL;
+      return false;
+    }
+    
+    // the engine doesn't report accesses to bad addresses, so there's nothing more to compare
+    if (result == REFERENCE_ILLEGAL_ADDRESS)
+      reference.accesses = engine_accesses = 0;
+    
+    if (machine->state.PC != reference.PC)
+    {
+      sprintf(what, "the PC is %04x but should be %04x", machine->state.PC, reference.PC);
+      report_divergence(what, history, step);
+      access_observer = NULL;
+      return false;
+    }
+    
+    for (reg = 0; reg < REGISTERS; reg++)
+    {
+      if (machine->registers[reg] != reference.registers[reg])
+      {
+        sprintf(what, "R%d is %04x but should be %04x", reg, machine->registers[reg], reference.registers[reg]);
+        report_divergence(what, history, step);
+        access_observer = NULL;
+        return false;
+      }
+    }
+    
+    if (engine_accesses != reference.accesses)
+    {
+      sprintf(what, "the engine made %d data accesses but the reference made %d", engine_accesses, reference.accesses);
+      report_divergence(what, history, step);
+      access_observer = NULL;
+      return false;
+    }
+    
+    if (reference.accesses)
+    {
+      const Access &access = reference.access[0];
+      
+      reference_hit = reference_cache_access(reference_cache, access.addr);
+      if (engine_access.addr != access.addr || engine_access.value != access.value || engine_access.op != access.op)
+        sprintf(what, "the data access doesn't match");
+      else if (access.op == ACCESS_WRITE && engine_word(access.addr) != reference.memory[access.addr])
+        sprintf(what, "memory at %04x is %04x but should be %04x", access.addr, engine_word(access.addr),
+                reference.memory[access.addr]);
+      // other configurations are free to hit and miss differently
+      else if (reference_cache_applies() && engine_hit != reference_hit)
+        sprintf(what, "the access to %04x was a %s but should be a %s", access.addr, engine_hit ? "hit" : "miss",
+                reference_hit ? "hit" : "miss");
       else
+        what[0] = '\0';
+      
+      if (what[0])
       {
-        // register
-        registers[reg] = state.MDR;
+        report_divergence(what, history, step);
+        access_observer = NULL;
+        return false;
       }
-      break;
-      
-    default:
-      break;
+    }
   }
+  access_observer = NULL;
   
-  // don't forget to increment the program counter
-  state.PC++;
+  // finally, everything written back has to match
+  for (i = 0; i < CACHE_BLOCKS; i++)
+    write_block(i);
+  if (memcmp(machine->data, reference.memory, sizeof(reference.memory)) != 0)
+  {
+    for (i = 0; i < DATA_WORDS && (&machine->data[0][0])[i] == reference.memory[i]; i++)
+      ;
+    sprintf(what, "after writing back the cache, memory at %04x is %04x but should be %04x", i, (&machine->data[0][0])[i],
+            reference.memory[i]);
+    report_divergence(what, history, step ? step - 1 : 0);
+    return false;
+  }
   
-  return rc;
+  return true;
 }
 
-////////////////////////////////////////////////////////////////////
-// general routines
+// a small xorshift generator for our random programs
+static unsigned long fuzz_random(unsigned long &seed)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  
+  return seed;
+}
 
-// initializes us to get going
-void initialize_system()
+// builds a random program and data area
+// most instructions are valid, memory addresses are masked into the data area first and branches
+// are kept short, so that programs get a chance to do something interesting before stopping
+void fuzz_program(unsigned long &seed)
 {
-  int i, j;
+  int pc = 0;
+  int reg1, reg2;
+  int op, how;
+  int shifts, max_shift = 0;
+  int i;
   
-  state.PC = 0;
-  state.MDR = 0;
-  state.MAR = 0;
-  state.ALU_x = 0;
-  state.ALU_y = 0;
-  state.ALU_z = 0;
+  for (i = 0; i < DATA_WORDS; i++)
+    (&machine->data[0][0])[i] = (uint16_t)fuzz_random(seed);
   
-  // fill all of our code and data space
-  for (i = 0; i < CODE_SIZE; i++)
-  {
-    code[i][0] = MEM_FILLER;
-    code[i][1] = MEM_FILLER;
-  }
-  for (i = 0; i < DATA_SIZE; i++)
+  // the most we can shift a masked address and stay in the data area
+  while ((31 << (max_shift + 1)) < DATA_WORDS)
+    max_shift++;
+  
+  while (pc < FUZZ_CODE)
   {
-    for (j = 0; j < BLOCK_SIZE; j++)
+    reg1 = fuzz_random(seed) % REGISTERS;
+    reg2 = fuzz_random(seed) % REGISTERS;
+    op = fuzz_random(seed) % NUM_OPCODES;
+    how = fuzz_random(seed) % 2;
+    
+    switch (fuzz_random(seed) % 8)
     {
-      data[i][j][0] = MEM_FILLER;
-      data[i][j][1] = MEM_FILLER;
+      // now and then, a completely random word -- mostly illegal
+      case 0:
+        if (fuzz_random(seed) % 8 == 0)
+        {
+          machine->code[pc][0] = (unsigned char)fuzz_random(seed);
+          machine->code[pc][1] = (unsigned char)fuzz_random(seed);
+          pc++;
+          break;
+        }
+        // fall through -- otherwise it's a memory access
+        
+      case 1:
+      case 2:
+        // a load or store through an address spread over the data area, if there's room
+        shifts = fuzz_random(seed) % (max_shift + 1);
+        if (pc + 2 + shifts <= FUZZ_CODE)
+        {
+          int addr_reg = (op & 1) ? reg1 : reg2;
+          
+          // AND Rx,31 then SHL Rx a few times, so the accesses reach every part of the data area
+          // and evict each other -- but we sometimes leave the address alone
+          if (fuzz_random(seed) % 16)
+          {
+            machine->code[pc][0] = (AND_OPCODE << 5) | (addr_reg >> 2);
+            machine->code[pc][1] = ((addr_reg & 0x03) << 6) | 0x1F;
+            pc++;
+            for (; shifts > 0; shifts--)
+            {
+              machine->code[pc][0] = (SHIFT_OPCODE << 5) | (1 << 2) | (addr_reg >> 2);
+              machine->code[pc][1] = (addr_reg & 0x03) << 6;
+              pc++;
+            }
+          }
+          how = (op & 1) ? ((fuzz_random(seed) % 2) ? 5 : 4) : 1;
+          machine->code[pc][0] = (MOVE_OPCODE << 5) | (how << 2) | (reg1 >> 2);
+          machine->code[pc][1] = ((reg1 & 0x03) << 6) | (how == 4 ? (fuzz_random(seed) & 0x3F) : (reg2 << 2));
+          pc++;
+          break;
+        }
+        // fall through -- otherwise it's a branch
+        
+      case 3:
+        // a short branch
+        how = fuzz_random(seed) % 7;
+        machine->code[pc][0] = (BRANCH_OPCODE << 5) | (how << 2) | (reg1 >> 2);
+        machine->code[pc][1] = ((reg1 & 0x03) << 6) | ((fuzz_random(seed) % 9 - 4) & 0x3F);
+        pc++;
+        break;
+        
+      // anything else that's valid
+      default:
+        if (op == BRANCH_OPCODE)
+          op = SHIFT_OPCODE;
+        if (op == MOVE_OPCODE)
+          how = (fuzz_random(seed) % 2) ? 0 : 1;
+        machine->code[pc][0] = (op << 5) | (how << 2) | (reg1 >> 2);
+        machine->code[pc][1] = ((reg1 & 0x03) << 6) | ((how && op != SHIFT_OPCODE) ? (reg2 << 2) : (fuzz_random(seed) & 0x3F));
+        pc++;
+        break;
     }
   }
+}
+
+// runs a number of random programs through the differential harness
+// returns true if every one of them agreed
+bool fuzz(unsigned long seed, unsigned long count)
+{
+  unsigned long program;
+  unsigned long program_seed;
+  unsigned long instructions = 0;
+  unsigned long accesses = 0;
   
-  // initialize our registers
-  for (i = 0; i < REGISTERS; i++)
-    registers[i] = 0;
-  
-  // initialize our cache to be empty
-  for (i = 0; i < CACHE_BLOCKS; i++)
+  for (program = 0; program < count; program++)
   {
-    dictionary[i].valid = false;
-    dictionary[i].dirty = false;
-    dictionary[i].tag = 0;
-    dictionary[i].ref_count = 0;
+    // each program gets its own seed so that a failure can be repeated on its own
+    program_seed = seed + program;
     
-    // initialize all cache data -- not required but we'll see any bad references this way...
-    for (j = 0; j < BLOCK_SIZE; j++)
+    initialize_system();
+    fuzz_random(program_seed);
+    fuzz_program(program_seed);
+    if (!run_differential(FUZZ_LIMIT))
     {
-      data_cache[i][j][0] = MEM_FILLER;
-      data_cache[i][j][1] = MEM_FILLER;
+      printf("Random program %ld (seed %ld) diverged.\n", program, seed + program);
+      return false;
     }
+    instructions += machine->instruction_count;
+    accesses += machine->access_count;
   }
+  
+  printf("All %ld random programs agreed (%ld instructions, %ld data accesses).\n", count, instructions, accesses);
+  return true;
 }
 
-// checks the hex value to ensure it a printable ASCII character. If
-// it isn't, '.' is returned instead of itself
-char valid_ascii(unsigned char hex_value)
+
+////////////////////////////////////////////////////////////////////
+// interleaved job routines
+//
+// Running thousands of tiny simulations one after another leaves the host waiting on its own
+// memory every time a simulation touches a cold cache line. Instead, -m gives each job its own
+// machine and runs them round robin on one thread, treating each one as a coroutine. The control
+// unit is already a state machine, so a machine's phase is all we need to resume it. A machine
+// runs until calculate_ea() has worked out the address of a load or store; we then prefetch the
+// dictionary set and memory block that access will need and move on to the next machine, so the
+// prefetch has the other machines' work to hide behind. Machines share nothing, so each job's
+// results are exactly what it gets when run on its own.
+//
+// The exception is -w, where the machines share the bus to memory. Their accesses then have to
+// reach the bus in the order of their cycle counts, so rather than going round robin we always
+// resume the machine that's furthest behind, which is about to make its access at that cycle.
+
+// what we remember about each job
+struct JOB
 {
-  if (hex_value < 0x21 || hex_value > 0x7e)
-    hex_value = '.';
+  string   code_filename;
+  string   data_filename;
+  Machine *machine;
+  bool     loaded;
+};
+
+typedef struct JOB Job;
+
+// makes a new machine, keeping the alignment of its memory and cache
+Machine *new_machine()
+{
+  void *memory = NULL;
   
-  return (char)hex_value;
+  if (posix_memalign(&memory, STORAGE_ALIGN, sizeof(Machine)) != 0)
+    return NULL;
+  
+  return new (memory) Machine;
 }
 
-// takes the data and prints it out in hexadecimal and ASCII form
-void print_memory()
+void delete_machine(Machine *old_machine)
+{
+  old_machine->~Machine();
+  free(old_machine);
+}
+
+// loads a job's code and data into the current machine without any of the chatter of load_files()
+bool load_job(const Job &job)
 {
-  int block_index = 0;
-  int word_index = 0;
-  int text_index = 0;
-  char the_text[LINE_LENGTH+1];
+  FILE *code_file = fopen(job.code_filename.c_str(), "rb");
+  std::ifstream data_file(job.data_filename.c_str());
+  string line;
+  int data_index = 0;
   
-  // print each line 1 at a time
-  for (block_index = 0; block_index < DATA_SIZE; block_index++)
+  if (!code_file || !data_file.is_open())
   {
-    // add 1 word at a time, but don't go beyond the end of the data
-    for (word_index = 0; word_index < BLOCK_SIZE; word_index++)
-    {
-      the_text[text_index++] = valid_ascii((unsigned char)(data[block_index][word_index][0]));
-      the_text[text_index++] = valid_ascii((unsigned char)(data[block_index][word_index][1]));
-      printf("%02x%02x ", data[block_index][word_index][0], data[block_index][word_index][1]);
-      
-      // print out a line if we're at the end
-      if (text_index == LINE_LENGTH)
-      {
-        text_index = 0;
-        the_text[LINE_LENGTH] = '\0';
-        printf("\t\'%s\'\n", the_text);
-      }
-    }
+    if (code_file)
+      fclose(code_file);
+    return false;
+  }
+  
+  if (fread(machine->code, 1, CODE_SIZE * WORD_SIZE, code_file) == 0 && ferror(code_file))
+  {
+    fclose(code_file);
+    return false;
   }
+  fclose(code_file);
+  
+  while (getline(data_file, line))
+    insert_data(line, data_index);
+  
+  return true;
 }
 
-// converts the passed string into binary form and inserts it into our data area
-// assumes an even number of characters!!!
-void insert_data(string line)
+// runs the current machine until it's about to access data memory or stops
+Phase run_until_access()
 {
-  static int data_index = 0;
-  unsigned int i;
-  unsigned char byte1, byte2;
+  Phase current_phase = machine->phase;
+  Phase previous_phase;
+  
+  do
+  {
+    previous_phase = current_phase;
+    current_phase = control_unit[current_phase]();
+    machine->cycle_count++;
+    
+    if (current_phase == FETCH_INSTR)
+      current_phase = end_instruction();
+    
+    // calculate_ea() has just loaded the MAR for anything but a literal move
+  } while (current_phase < NUM_PHASES && !(previous_phase == CALCULATE_EA && mode() != 0));
+  
+  machine->phase = current_phase;
+  return current_phase;
+}
 
-  for (i = 0; i < line.length(); i += 4)
+// reads the jobs file -- each line has an object file and a data file
+bool read_jobs(const char *jobs_filename, vector<Job> &jobs)
+{
+  std::ifstream jobs_file(jobs_filename);
+  string line;
+  char code_filename[1024], data_filename[1024];
+  
+  if (!jobs_file.is_open())
   {
-    if (data_index < DATA_SIZE * BLOCK_SIZE)
-    {
-      sscanf(line.substr(i, 4).c_str(), "%02hhx%02hhx", &byte1, &byte2);
-      data[data_index / BLOCK_SIZE][data_index % BLOCK_SIZE][0] = byte1;
-      data[data_index / BLOCK_SIZE][data_index % BLOCK_SIZE][1] = byte2;
-      data_index++;
-    }
-    else
+    printf("Failed to open jobs file %s.\n", jobs_filename);
+    return false;
+  }
+  
+  while (getline(jobs_file, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    
+    if (sscanf(line.c_str(), "%1023s %1023s", code_filename, data_filename) != 2)
     {
-      printf("Warning: Data exceeds allocated memory size.\n");
-      break;
+      printf("Can't make sense of the job '%s'.\n", line.c_str());
+      return false;
     }
+    
+    Job job = { code_filename, data_filename, NULL, false };
+    jobs.push_back(job);
   }
+  
+  return true;
 }
 
-// reads in the file data and returns true if our code and data areas are ready for processing
-bool load_files(const char *code_filename, const char *data_filename)
+// runs every job in the jobs file, interleaved on this thread, and reports each one's results
+bool run_jobs(const char *jobs_filename)
 {
-  FILE *code_file = NULL;
-  std::ifstream data_file(data_filename);
-  string line;           // used to read in a line of text
-  bool rc = false;
+  static const char *endings[] = { "illegal opcode", "infinite loop", "illegal address", "budget exhausted" };
+  vector<Job> jobs;
+  vector<size_t> running;
+  vector<unsigned long> instructions, cycles;
+  size_t next, i;
+  long total_instructions = 0, total_cycles = 0;
+  unsigned long longest_cycles = 0;
+  int changed_lines;
+  int block;
   
-  printf("Attempting to open code file: %s\n", code_filename);
-  code_file = fopen(code_filename, "rb");  // Changed "r" to "rb" for binary mode
+  if (!read_jobs(jobs_filename, jobs))
+    return false;
+  if (share_cache)
+    qos_start(jobs.size());
   
-  if (code_file)
+  for (i = 0; i < jobs.size(); i++)
   {
-    printf("Code file opened successfully.\n");
-    size_t bytes_read = fread(code, 1, CODE_SIZE * WORD_SIZE, code_file);
-    printf("Read %zu bytes from code file.\n", bytes_read);
-    
-    fclose(code_file);
+    machine = jobs[i].machine = new_machine();
+    if (!machine)
+    {
+      printf("Out of memory for job %zu.\n", i);
+      while (i > 0)
+        delete_machine(jobs[--i].machine);
+      machine = &main_machine;
+      return false;
+    }
     
-    printf("Attempting to open data file: %s\n", data_filename);
-    if (data_file.is_open())
+    initialize_system();
+    machine->qos_program = i;
+    jobs[i].loaded = load_job(jobs[i]);
+    if (jobs[i].loaded)
     {
-      printf("Data file opened successfully.\n");
-      int line_count = 0;
-      while (getline(data_file, line))
+      snapshot_memory();
+      running.push_back(i);
+    }
+  }
+  
+  // go round the running machines until they've all stopped, keeping them in order
+  while (!running.empty() && !bus_width)
+  {
+    for (i = next = 0; i < running.size(); i++)
+    {
+      machine = jobs[running[i]].machine;
+      if (run_until_access() < NUM_PHASES)
       {
-        insert_data(line);
-        line_count++;
+        prefetch_access(machine->state.MAR);
+        running[next++] = running[i];
       }
-      printf("Read %d lines from data file.\n", line_count);
-      data_file.close();
-      
-      rc = true;
+      else
+      {
+        for (block = 0; block < CACHE_BLOCKS; block++)
+          write_block(block);
+      }
+    }
+    running.resize(next);
+  }
+  
+  // or with a shared bus, take them in order of time
+  while (!running.empty())
+  {
+    for (i = 0, next = 1; next < running.size(); next++)
+    {
+      if (jobs[running[next]].machine->cycle_count < jobs[running[i]].machine->cycle_count)
+        i = next;
     }
+    
+    // a machine that's stopped writes its cache back once the others have caught up with it
+    machine = jobs[running[i]].machine;
+    if (machine->phase < NUM_PHASES)
+      run_until_access();
     else
     {
-      printf("Failed to open data file.\n");
+      for (block = 0; block < CACHE_BLOCKS; block++)
+        write_block(block);
+      running.erase(running.begin() + i);
     }
   }
-  else
-  {
-    printf("Failed to open code file.\n");
-  }
   
-  if (rc)
+  for (i = 0; i < jobs.size(); i++)
   {
-    printf("Code memory contents:\n");
-    for (int i = 0; i < CODE_SIZE && i < 32; i += 2)
+    machine = jobs[i].machine;
+    if (!jobs[i].loaded)
+      printf("job %zu %s %s: failed to load\n", i, jobs[i].code_filename.c_str(), jobs[i].data_filename.c_str());
+    else
     {
-      printf("%04x: %02x%02x\n", i, code[i][0], code[i][1]);
+      uint64_t hash = hash_memory(changed_lines);
+      
+      printf("job %zu %s %s: %s at %04x after %ld instructions, %ld cycles, %ld cache hits, %ld cache misses, "
+             "memory hash %016lx\n", i, jobs[i].code_filename.c_str(), jobs[i].data_filename.c_str(),
+             endings[machine->phase - ILLEGAL_OPCODE], machine->state.PC, machine->instruction_count,
+             machine->cycle_count, machine->cache_hits, machine->current_ref_count - machine->cache_hits - 1,
+             (unsigned long)hash);
+      if (bus_width)
+        printf("job %zu spent %ld cycles waiting on the bus\n", i, machine->bus_stall_cycles);
+      total_instructions += machine->instruction_count;
+      total_cycles += machine->cycle_count;
+      longest_cycles = std::max(longest_cycles, machine->cycle_count);
     }
-    printf("...\n");
+    instructions.push_back(jobs[i].loaded ? machine->instruction_count : 0);
+    cycles.push_back(jobs[i].loaded ? machine->cycle_count : 0);
+    delete_machine(jobs[i].machine);
+  }
+  machine = &main_machine;
+  
+  printf("Ran %zu jobs for a total of %ld instructions in %ld cycles.\n", jobs.size(), total_instructions, total_cycles);
+  print_bus_statistics(longest_cycles);
+  if (share_cache)
+    print_qos(instructions, cycles);
+  
+  return true;
+}
 
-    printf("Data memory contents:\n");
-    for (int i = 0; i < DATA_SIZE && i < 16; i++)
-    {
-      for (int j = 0; j < BLOCK_SIZE; j++)
-      {
-        printf("%04x: %02x%02x ", i * BLOCK_SIZE + j, data[i][j][0], data[i][j][1]);
-      }
-      printf("\n");
-    }
-    printf("...\n");
+
+////////////////////////////////////////////////////////////////////
+// command line handling
+
+// shows how we're meant to be run
+void usage(const char *program)
+{
+  printf("usage: %s [options] <object_file> <data_file>\n", program);
+  printf("       %s [options] [-j threads [-p]] -r trace_file\n", program);
+  printf("       %s -v [-s sector_size] [-i instructions] <object_file> <data_file>\n", program);
+  printf("       %s -f seed:count\n", program);
+  printf("       %s [-w bus_width] [-Q masks] [-i instructions] [-c cycles] [-a accesses] -m jobs_file\n", program);
+  printf("       %s -x image_file image_file\n", program);
+  printf("the cache:\n");
+  printf("  -e policy          replace cache blocks with lru (default), bip, dip, arc, ship or hawkeye\n");
+  printf("  -y                 bypass the cache for blocks ship or hawkeye predict won't be reused\n");
+  printf("  -n index           index the sets by mod (default), xor, prime or skew\n");
+  printf("  -z                 relocate blocks to make room when the index is skew\n");
+  printf("  -s sector_size     split blocks into sectors of this many words, filled and written back separately\n");
+  printf("  -k compression     compress lines with none (default), bdi or fpc, with %d tags per line of data\n",
+         COMPRESSION_TAGS);
+  printf("  -S                 keep blocks clean when a store leaves the word as it was\n");
+  printf("  -Z                 count all zero lines, and write them back as a flag instead of their data\n");
+  printf("memory:\n");
+  printf("  -g page_policy     put DRAM behind the cache with none (default), open or closed pages\n");
+  printf("  -w bus_width       limit the bus between the cache and memory to this many bytes a cycle\n");
+  printf("other caches, alongside ours:\n");
+  printf("  -l rate[:blocks]   estimate the miss ratio curve, sampling this fraction of the blocks (at most blocks)\n");
+  printf("  -o                 count the misses of every LRU geometry with this block size in one pass\n");
+  printf("  -h hierarchies     replay our misses and writebacks through lower levels, e.g. 64x4+256x8,128x8\n");
+  printf("  -D caches          simulate up to %d direct mapped caches in lockstep, e.g. 64x8,128x4\n", LOCKSTEP_LANES);
+  printf("  -Q masks           model the jobs sharing one cache: unpartitioned, with CAT masks and with UCP\n");
+  printf("                     (masks is even, or 0xmask,... for each job)\n");
+  printf("running:\n");
+  printf("  -q                 don't show each phase as it runs\n");
+  printf("  -i instructions    stop after executing this many instructions (default %d, 0 for no limit)\n",
+         INSTRUCTION_LIMIT);
+  printf("  -c cycles          stop after this many cycles\n");
+  printf("  -a accesses        stop after this many data accesses\n");
+  printf("  -t trace_file      record every data access to trace_file\n");
+  printf("  -r trace_file      replay trace_file through the cache instead of running a program\n");
+  printf("  -j threads         replay with this many threads sharing the cache\n");
+  printf("  -p                 split the sets between the replay threads instead of sharing them\n");
+  printf("  -m jobs_file       run each object and data file pair listed in jobs_file, interleaved on one thread\n");
+  printf("checking:\n");
+  printf("  -v                 run alongside the reference interpreter and cache, reporting any divergence\n");
+  printf("  -f seed:count      check count random programs against the reference, starting from seed\n");
+  printf("output:\n");
+  printf("  -u                 list the accesses and misses of every set, and how the lookaside did\n");
+  printf("  -d dump            dump all (default), modified, none or start:end (word addresses) of memory\n");
+  printf("  -b image_file      save the final data area to image_file as a big endian binary image\n");
+  printf("  -x image_file image_file\n");
+  printf("                     compare two saved images instead of running a program\n");
+}
+
+// makes sure the options we were given can be used together, saying what's wrong if they can't
+// threaded is whether a replay uses more than one thread, and per_run_output whether we were asked
+// to trace, dump, save or verify a single run
+bool check_options(bool threaded, bool jobs, bool per_run_output)
+{
+  if (replacement_policy == POLICY_DIP && CACHE_SETS < 2)
+  {
+    printf("Set dueling needs at least two sets.\n");
+    return false;
   }
-  return rc;
+  
+  if (bypass_dead_blocks && replacement_policy != POLICY_SHIP && replacement_policy != POLICY_HAWKEYE)
+  {
+    printf("Only the %s and %s policies can bypass the cache.\n", policy_names[POLICY_SHIP], policy_names[POLICY_HAWKEYE]);
+    return false;
+  }
+  
+  if (relocate_blocks && index_function != INDEX_SKEW)
+  {
+    printf("Blocks can only be relocated with %s indexing.\n", index_names[INDEX_SKEW]);
+    return false;
+  }
+  
+  // skewed placement has no sets for the other policies to work on or threads to split between
+  if (index_function == INDEX_SKEW && (replacement_policy != POLICY_LRU || threaded))
+  {
+    printf("Only the %s policy can be used with %s indexing, with one thread.\n", policy_names[POLICY_LRU],
+           index_names[INDEX_SKEW]);
+    return false;
+  }
+  
+  // compressed lines are sized and evicted a whole line at a time, by LRU within a set
+  if (compression != COMPRESSION_NONE &&
+      (CACHE_WAYS < COMPRESSION_TAGS || replacement_policy != POLICY_LRU || index_function == INDEX_SKEW ||
+       sector_size != BLOCK_SIZE || threaded))
+  {
+    printf("A compressed cache needs at least %d ways, the %s policy, whole blocks, sets and one thread.\n",
+           COMPRESSION_TAGS, policy_names[POLICY_LRU]);
+    return false;
+  }
+  
+  if ((page_policy != PAGE_NONE || bus_width) && threaded)
+  {
+    printf("The DRAM and bus models only work with one thread.\n");
+    return false;
+  }
+  
+  if ((mrc_rate || sweep || !hierarchies.empty() || lockstep.lanes) && (threaded || jobs))
+  {
+    printf("The miss ratio curve and the sweeps need one thread and one program.\n");
+    return false;
+  }
+  
+  // jobs only report their counts and memory hashes
+  if (jobs && per_run_output)
+  {
+    printf("Jobs can't be traced, dumped, saved or verified.\n");
+    return false;
+  }
+  
+  if (share_cache && !jobs)
+  {
+    printf("The shared cache model needs a jobs file to share it between.\n");
+    return false;
+  }
+  
+  // the shared cache model is made of sets, which skewed placement doesn't have
+  if (share_cache && index_function == INDEX_SKEW)
+  {
+    printf("The shared cache model can't be used with %s indexing.\n", index_names[INDEX_SKEW]);
+    return false;
+  }
+  
+  if (replacement_policy != POLICY_LRU && threaded)
+  {
+    printf("Only the %s policy can be replayed with more than one thread.\n", policy_names[POLICY_LRU]);
+    return false;
+  }
+  
+  return true;
 }
 
 // runs our simulation after initializing our memory
 int main(int argc, const char *argv[])
 {
   Phase current_phase = FETCH_INSTR;  // we always start with an instruction fetch
+  const char *record_filename = NULL;
+  const char *replay_filename = NULL;
+  const char *diff_filenames[2] = { NULL, NULL };
+  const char *jobs_filename = NULL;
+  bool verify = false;
+  unsigned long fuzz_seed = 0;
+  unsigned long fuzz_count = 0;
+  int threads = 1;
+  bool partitioned = false;
+  bool saved = true;
+  bool dump_given = false;
+  bool budgets_given = false;
+  int arg = 1;
   int i;
+  
+  // pull off our options
+  while (arg < argc && argv[arg][0] == '-')
+  {
+    if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
+    {
+      budgets[INSTRUCTION_BUDGET] = strtoul(argv[++arg], NULL, 0);
+      budgets_given = true;
+    }
+    else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+    {
+      budgets[CYCLE_BUDGET] = strtoul(argv[++arg], NULL, 0);
+      budgets_given = true;
+    }
+    else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc)
+    {
+      budgets[ACCESS_BUDGET] = strtoul(argv[++arg], NULL, 0);
+      budgets_given = true;
+    }
+    else if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc && parse_dump(argv[arg + 1]))
+    {
+      dump_given = true;
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-q") == 0)
+      show_phases = false;
+    else if (strcmp(argv[arg], "-e") == 0 && arg + 1 < argc && parse_policy(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-y") == 0)
+      bypass_dead_blocks = true;
+    else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc && parse_sector_size(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc && parse_index(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc && parse_compression(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-g") == 0 && arg + 1 < argc && parse_page_policy(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+      bus_width = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "-l") == 0 && arg + 1 < argc && parse_mrc(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-o") == 0)
+      sweep = true;
+    else if (strcmp(argv[arg], "-h") == 0 && arg + 1 < argc && parse_hierarchies(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-D") == 0 && arg + 1 < argc && parse_lockstep(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-S") == 0)
+      eliminate_silent_stores = true;
+    else if (strcmp(argv[arg], "-Z") == 0)
+      track_zero_lines = true;
+    else if (strcmp(argv[arg], "-Q") == 0 && arg + 1 < argc && parse_cat_masks(argv[arg + 1]))
+      arg++;
+    else if (strcmp(argv[arg], "-z") == 0)
+      relocate_blocks = true;
+    else if (strcmp(argv[arg], "-u") == 0)
+      show_sets = true;
+    else if (strcmp(argv[arg], "-v") == 0)
+      verify = true;
+    else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc &&
+             sscanf(argv[arg + 1], "%lu:%lu", &fuzz_seed, &fuzz_count) == 2)
+      arg++;
+    else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc)
+      jobs_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-x") == 0 && arg + 2 < argc)
+    {
+      diff_filenames[0] = argv[++arg];
+      diff_filenames[1] = argv[++arg];
+    }
+    else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc)
+      image_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+      record_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+      replay_filename = argv[++arg];
+    else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+      threads = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "-p") == 0)
+      partitioned = true;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    arg++;
+  }
+  
+  if (!check_options(threads > 1 || partitioned, jobs_filename != NULL,
+                     record_filename || dump_given || image_filename || verify))
+    return 1;
+  prime_sets = largest_prime(CACHE_SETS);
+  
+  // the lookaside belongs to the machine, so threads would trip over each other's
+  if (threads > 1 || partitioned)
+    use_lookaside = false;
+  
+  if (diff_filenames[0])
+    return diff_images(diff_filenames[0], diff_filenames[1]) ? 0 : 1;
+  
+  if (jobs_filename)
+  {
+    show_phases = false;
+    build_dump_tables();
+    return run_jobs(jobs_filename) ? 0 : 1;
+  }
+  
+  if (fuzz_count)
+  {
+    show_phases = false;
+    return fuzz(fuzz_seed, fuzz_count) ? 0 : 1;
+  }
+  
+  if (replay_filename)
+  {
+    initialize_system();
+    snapshot_memory();
+    return replay_trace(replay_filename, threads, partitioned) ? 0 : 1;
+  }
+  
+  if (argc - arg != 2)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  
+  if (record_filename)
+  {
+    trace_file = fopen(record_filename, "wb");
+    if (!trace_file)
+    {
+      printf("Failed to open trace file %s.\n", record_filename);
+      return 1;
+    }
+  }
+  
   printf("Starting caching simulator...\n");
   initialize_system();
   printf("Attempting to load files...\n");
   
   // read in our code and data
-  if (load_files(argv[1], argv[2]))
+  if (load_files(argv[arg], argv[arg + 1]))
   {
     printf("Files loaded successfully.\n");
+    snapshot_memory();
+    
+    // check the control unit against the reference instead of a normal run
+    if (verify)
+    {
+      show_phases = false;
+      if (!run_differential(budgets[INSTRUCTION_BUDGET] ? budgets[INSTRUCTION_BUDGET] : ULONG_MAX))
+        return 1;
+      
+      printf("The control unit and the reference agreed for %ld instructions and %ld data accesses.\n",
+             machine->instruction_count, machine->access_count);
+      return 0;
+    }
     
     // run our simulator
     while (current_phase < NUM_PHASES)
-      current_phase = control_unit[current_phase]();
+      current_phase = run_instruction();
     
     // write back the contents of the cache
     for (i = 0; i < CACHE_BLOCKS; i++)
@@ -925,30 +6613,49 @@ int main(int argc, const char *argv[])
     {
       case ILLEGAL_OPCODE:
         printf("Illegal instruction %02x%02x detected at address %04x\n\n",
-               state.IR[0], state.IR[1], state.PC);
+               machine->state.IR[0], machine->state.IR[1], machine->state.PC);
         break;
         
       case INFINITE_LOOP:
-        printf("Possible infinite loop detected with instruction %02x%02x at address %04x\n\n",
-               state.IR[0], state.IR[1], state.PC);
+        printf("Infinite loop detected with instruction %02x%02x at address %04x\n\n",
+               machine->state.IR[0], machine->state.IR[1], machine->state.PC);
+        break;
+        
+      case BUDGET_EXHAUSTED:
+        printf("The %s budget of %ld was exhausted at address %04x\n\n",
+               budget_names[machine->exhausted_budget], budgets[machine->exhausted_budget], machine->state.PC);
         break;
         
       case ILLEGAL_ADDRESS:
         printf("Illegal address %04x detected with instruction %02x%02x at address %04x\n\n",
-               state.MAR, state.IR[0], state.IR[1], state.PC);
+               machine->state.MAR, machine->state.IR[0], machine->state.IR[1], machine->state.PC);
         break;
         
       default:
         break;
     }
     
-    // print our cache statistics
-    printf("There were a total of %ld cache hits and %ld cache misses, for a hit rate of %4.3f.\n\n",
-           cache_hits, current_ref_count - cache_hits - 1,
-           (double)cache_hits / (double)(current_ref_count - 1));
+    // finish off the trace
+    if (trace_file)
+    {
+      fwrite(trace_buffer, sizeof(Access), trace_count, trace_file);
+      fclose(trace_file);
+    }
     
-    // print out the data area
+    // print our run and cache statistics -- the run's only worth showing if it was limited
+    if (budgets_given || current_phase == BUDGET_EXHAUSTED || current_phase == INFINITE_LOOP)
+      print_run_statistics();
+    print_statistics();
+    print_policy_statistics();
+    print_memory_hash();
+    
+    // print out the data area and save it if asked to
     print_memory();
+    if (image_filename && !write_image(image_filename))
+      saved = false;
+    
+    // and where we spent our time, if we're profiling
+    print_profile();
   }
   else
   {
@@ -956,5 +6663,5 @@ int main(int argc, const char *argv[])
     return 1;
   }
 
-  return 0;
+  return saved ? 0 : 1;
 }
\ No newline at end of file